@@ -0,0 +1,210 @@
+// Tests for the MPRIS album art cache
+//
+// Serves a PNG over loopback HTTP and checks that ArtCache writes a
+// downsampled thumbnail and emits signal_ready, that a cached URL is
+// returned right away, and that a URL that failed is not fetched again.
+// Runs itself again with an empty cache directory (the cache paths are
+// fixed at startup).
+//
+// art_test
+
+#include "mpris.h"
+#include "utils.h"
+
+#include <gdkmm/pixbuf.h>
+#include <glibmm.h>
+#include <gtkmm/application.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Served image, downsampled to fit in ART_SIZE (128)
+static const int IMAGE_WIDTH = 300;
+static const int IMAGE_HEIGHT = 200;
+static const int THUMBNAIL_SIZE = 128;
+static const int TIMEOUT_MS = 5000;
+// Time for a request that shouldn't happen to reach the server
+static const int QUIET_MS = 500;
+
+// Minimal HTTP/1.0 server, one request per connection. /cover.png is the
+// image, everything else is a 404.
+class HttpServer {
+public:
+    HttpServer(const std::string &image) : image(image) {
+        sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = 0;
+        socklen_t len = sizeof(address);
+        if (sock < 0 || bind(sock, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) < 0 ||
+            listen(sock, 8) < 0 || getsockname(sock, reinterpret_cast<struct sockaddr *>(&address), &len) < 0) {
+            Utils::log(Utils::LogSeverity::ERROR, std::format("art_test: cannot listen on loopback: {}", strerror(errno)));
+            return;
+        }
+        port = ntohs(address.sin_port);
+        thread = std::thread(&HttpServer::serve, this);
+    }
+    ~HttpServer() {
+        if (thread.joinable()) {
+            // Unblocks accept()
+            shutdown(sock, SHUT_RDWR);
+            thread.join();
+        }
+        if (sock >= 0)
+            close(sock);
+    }
+
+    std::string url(const std::string &path) const { return std::format("http://127.0.0.1:{}{}", port, path); }
+
+    int port = 0;
+    std::atomic<int> image_requests = 0;
+    std::atomic<int> missing_requests = 0;
+
+private:
+    void serve() {
+        while (true) {
+            int client = accept(sock, nullptr, nullptr);
+            if (client < 0)
+                break;
+            std::string request;
+            char buffer[1024];
+            ssize_t n;
+            while (request.find("\r\n\r\n") == std::string::npos && (n = read(client, buffer, sizeof(buffer))) > 0)
+                request.append(buffer, n);
+            std::string response;
+            if (request.starts_with("GET /cover.png ")) {
+                ++image_requests;
+                response = std::format("HTTP/1.0 200 OK\r\nContent-Type: image/png\r\nContent-Length: {}\r\n\r\n", image.size()) + image;
+            } else {
+                ++missing_requests;
+                response = "HTTP/1.0 404 Not Found\r\nContent-Length: 9\r\n\r\nnot found";
+            }
+            for (size_t sent = 0; sent < response.size();) {
+                n = write(client, response.data() + sent, response.size() - sent);
+                if (n <= 0)
+                    break;
+                sent += n;
+            }
+            close(client);
+        }
+    }
+
+    std::string image;
+    int sock = -1;
+    std::thread thread;
+};
+
+static bool check(bool condition, const std::string &what)
+{
+    std::cout << std::format("{}: {}\n", what, condition ? "ok" : "FAILED");
+    return condition;
+}
+
+// Runs the main loop until done() or the timeout
+static bool run_until(const std::function<bool()> &done)
+{
+    bool timeout = false;
+    auto timer = Glib::signal_timeout().connect([&timeout]() { timeout = true; return false; }, TIMEOUT_MS);
+    auto context = Glib::MainContext::get_default();
+    while (!done() && !timeout)
+        context->iteration(true);
+    timer.disconnect();
+    return !timeout;
+}
+
+static void run_for(int ms)
+{
+    bool done = false;
+    Glib::signal_timeout().connect_once([&done]() { done = true; }, ms);
+    auto context = Glib::MainContext::get_default();
+    while (!done)
+        context->iteration(true);
+}
+
+static int run_child()
+{
+    // Initializes the gtkmm wrappers (the cache uses Gdk::Pixbuf).
+    // The application is never registered, so no display is needed.
+    auto app = Gtk::Application::create("com.github.dawsers.gtkshell.test", Gio::Application::Flags::NON_UNIQUE);
+
+    auto pixbuf = Gdk::Pixbuf::create(Gdk::Colorspace::RGB, true, 8, IMAGE_WIDTH, IMAGE_HEIGHT);
+    pixbuf->fill(0x3080c0ff);
+    gchar *buffer = nullptr;
+    gsize size = 0;
+    pixbuf->save_to_buffer(buffer, size, "png");
+    HttpServer server(std::string(buffer, size));
+    g_free(buffer);
+    if (server.port == 0)
+        return 1;
+
+    auto &cache = ArtCache::get_instance();
+    std::map<Glib::ustring, std::string> ready;
+    cache.signal_ready.connect([&ready](const Glib::ustring &url, const std::string &path) { ready[url] = path; });
+
+    bool ok = true;
+    const Glib::ustring cover = server.url("/cover.png");
+    ok &= check(cache.lookup(cover) == "", "uncached URL is fetched");
+    ok &= check(run_until([&ready, &cover]() { return ready.contains(cover); }), "signal_ready emitted");
+    const std::string path = ready[cover];
+    ok &= check(path != "" && Glib::file_test(path, Glib::FileTest::EXISTS), "thumbnail written");
+    if (path != "") {
+        auto thumbnail = Gdk::Pixbuf::create_from_file(path);
+        auto width = thumbnail->get_width();
+        auto height = thumbnail->get_height();
+        // Fits, and keeps the aspect ratio give or take a pixel of rounding
+        ok &= check(width <= THUMBNAIL_SIZE && height <= THUMBNAIL_SIZE && width >= THUMBNAIL_SIZE - 1 &&
+                    std::abs(height * IMAGE_WIDTH - width * IMAGE_HEIGHT) <= IMAGE_WIDTH,
+                    std::format("thumbnail downsampled ({}x{})", width, height));
+    }
+    ok &= check(cache.lookup(cover) == path && server.image_requests == 1, "cached URL returned without fetching");
+
+    const Glib::ustring missing = server.url("/missing.png");
+    cache.lookup(missing);
+    ok &= check(run_until([&ready, &missing]() { return ready.contains(missing); }) && ready[missing] == "", "failed fetch reported");
+    ready.erase(missing);
+    ok &= check(cache.lookup(missing) == "", "failed URL not cached");
+    run_for(QUIET_MS);
+    ok &= check(server.missing_requests == 1 && !ready.contains(missing), "failed URL not fetched again");
+
+    return ok ? 0 : 1;
+}
+
+static int run_parent()
+{
+    char tmp_template[] = "/tmp/gtkshell-test-XXXXXX";
+    if (mkdtemp(tmp_template) == nullptr) {
+        Utils::log(Utils::LogSeverity::ERROR, std::format("art_test: cannot create a temporary directory: {}", strerror(errno)));
+        return 1;
+    }
+    const std::string tmp = tmp_template;
+    Glib::setenv("XDG_CACHE_HOME", tmp);
+    int status = 1;
+    try {
+        // Inherits our stdout and stderr
+        Glib::spawn_sync("", { "/proc/self/exe", "--child" }, Glib::SpawnFlags::DEFAULT, {}, nullptr, nullptr, &status);
+    } catch (const Glib::Error &error) {
+        Utils::log(Utils::LogSeverity::ERROR, std::format("art_test: cannot run the test: {}", error.what()));
+    }
+    std::error_code error;
+    std::filesystem::remove_all(tmp, error);
+    return status == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    Glib::init();
+    Gio::init();
+    return argc > 1 && strcmp(argv[1], "--child") == 0 ? run_child() : run_parent();
+}
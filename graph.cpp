@@ -1,4 +1,5 @@
 #include <glibmm.h>
+#include <giomm.h>
 #include <gtkmm/drawingarea.h>
 #include <gtkmm/box.h>
 #include <gtkmm/label.h>
@@ -13,11 +14,130 @@
 #include "bind.h"
 #include "utils.h"
 #include "graph.h"
+#include "proctable.h"
+
+// Decides how often the monitors sample.
+// Monitors run at their full rate while at least one of their Graphs is
+// mapped and the session is active, back off while the session is idle
+// (logind IdleHint), and pause while none of their Graphs is mapped.
+class SamplingPolicy {
+public:
+    static SamplingPolicy &get_instance() {
+        static SamplingPolicy instance;
+        return instance;
+    }
+
+    // Avoid copy creation
+    SamplingPolicy(const SamplingPolicy &) = delete;
+    void operator=(const SamplingPolicy &) = delete;
+
+    // Effective interval for a monitor whose full rate is one sample every
+    // "seconds" and that has "mapped" graphs. 0 means paused.
+    int get_interval(int seconds, int mapped) const {
+        if (mapped == 0)
+            return 0;
+        return idle ? seconds * IDLE_BACKOFF : seconds;
+    }
+
+    sigc::signal<void()> signal_changed;
+
+private:
+    SamplingPolicy() {
+        // https://www.freedesktop.org/software/systemd/man/latest/org.freedesktop.login1.html
+        Gio::DBus::Proxy::create_for_bus(Gio::DBus::BusType::SYSTEM, "org.freedesktop.login1", "/org/freedesktop/login1/session/auto", "org.freedesktop.login1.Session",
+            [this](Glib::RefPtr<Gio::AsyncResult> &result) {
+                try {
+                    session = Gio::DBus::Proxy::create_for_bus_finish(result);
+                } catch (const Glib::Error &error) {
+                    Utils::log(Utils::LogSeverity::WARNING, std::format("Graphs: cannot watch the session idle hint: {}", error.what()));
+                    return;
+                }
+                session->signal_properties_changed().connect(
+                    [this](const Gio::DBus::Proxy::MapChangedProperties &changed, const std::vector<Glib::ustring> &invalidated) {
+                        auto iter = changed.find("IdleHint");
+                        if (iter != changed.end())
+                            set_idle(iter->second.get_dynamic<bool>());
+                    });
+                Glib::Variant<bool> hint;
+                session->get_cached_property(hint, "IdleHint");
+                if (hint.gobj())
+                    set_idle(hint.get());
+            });
+    }
+
+    void set_idle(bool value) {
+        if (value != idle) {
+            idle = value;
+            signal_changed();
+        }
+    }
+
+    static constexpr int IDLE_BACKOFF = 6;
+    bool idle = false;
+    Glib::RefPtr<Gio::DBus::Proxy> session;
+};
+
+// Base for the monitors. Samples every "seconds" at full rate, following
+// SamplingPolicy, and exposes the effective interval as "sample-interval".
+class Monitor : public Glib::Object {
+public:
+    Glib::Property<int> sample_interval;
+
+    // Each monitor only samples while its own graphs are visible
+    void graph_mapped() {
+        if (mapped++ == 0)
+            reschedule();
+    }
+    void graph_unmapped() {
+        if (--mapped == 0)
+            reschedule();
+    }
+
+protected:
+    Monitor(int seconds) : sample_interval(*this, "sample-interval", 0), seconds(seconds) {
+        SamplingPolicy::get_instance().signal_changed.connect(sigc::mem_fun(*this, &Monitor::reschedule));
+    }
+
+    // Returns false if the monitor can't sample anymore
+    virtual bool sample() = 0;
+
+    void reschedule() {
+        if (failed)
+            return;
+        const int previous = sample_interval.get_value();
+        const int interval = SamplingPolicy::get_instance().get_interval(seconds, mapped);
+        if (interval == previous)
+            return;
+        timer.disconnect();
+        sample_interval.set_value(interval);
+        if (interval > 0) {
+            // Snap back: sample now instead of waiting for a full interval
+            if ((previous == 0 || interval < previous) && !sample()) {
+                failed = true;
+                return;
+            }
+            timer = Glib::signal_timeout().connect_seconds(
+                [this]() {
+                    failed = !sample();
+                    return !failed;
+                },
+                interval);
+        }
+    }
+
+private:
+    int seconds;
+    int mapped = 0;
+    bool failed = false;
+    sigc::connection timer;
+};
 
 class Graph : public Gtk::DrawingArea {
 public:
-    Graph(const Glib::Property<double> &variable, size_t hist, const Color &col)
+    Graph(Monitor &monitor, const Glib::Property<double> &variable, size_t hist, const Color &col)
         : value(variable), history(hist), color(col), data(hist, 0.0) {
+        signal_map().connect([&monitor]() { monitor.graph_mapped(); });
+        signal_unmap().connect([&monitor]() { monitor.graph_unmapped(); });
         value.get_proxy().signal_changed().connect([this]() {
             double d = value.get_value();
             if (!data.empty()) {
@@ -61,6 +181,17 @@ private:
 };
 
 
+// Live processes, shared by the CPU and memory monitors
+static ProcessTable &get_process_table()
+{
+    // After C++11 this is thread safe. No two threads are allowed to enter a
+    // variable declaration's initialization concurrently.
+    static ProcessTable table;
+
+    return table;
+}
+
+
 // CPU
 
 typedef struct {
@@ -82,47 +213,11 @@ typedef struct {
     size_t total_time;
 } ProcessUtilization;
 
-class CpuMonitor : public Glib::Object {
+class CpuMonitor : public Monitor {
 public:
     CpuMonitor(int seconds)
-        : Glib::ObjectBase(typeid(CpuMonitor)), cpu_load(*this, "cpu-load", 0.0), prev_idle_time(0), prev_total_time(0) {
-        timer = Glib::signal_timeout().connect_seconds(
-            [this]() {
-                /*
-                https://docs.kernel.org/filesystems/proc.html
-                user: normal processes executing in user mode
-                nice: niced processes executing in user mode
-                system: processes executing in kernel mode
-                idle: twiddling thumbs
-                iowait: waiting for I/O to complete
-                irq: servicing interrupts
-                softirq: servicing softirqs
-                */
-
-                std::ifstream proc_stat("/proc/stat");
-                proc_stat.ignore(5, ' '); // Skip the 'cpu' prefix.
-
-                std::vector<size_t> times;
-                for (size_t time; proc_stat >> time; times.push_back(time))
-                    ;
-
-                if (times.size() >= 4) {
-                    auto idle_time = times[3];
-                    // Accumulate only first four values, and skip IOWait, IRQ and SoftIRQ
-                    auto total_time = std::accumulate(times.begin(), times.begin() + 4, 0);
-                    const auto idle_time_delta = idle_time - prev_idle_time;
-                    prev_idle_time = idle_time;
-                    const auto total_time_delta = total_time - prev_total_time;
-                    prev_total_time = total_time;
-                    const double utilization = 100.0 * (1.0 - static_cast<double>(idle_time_delta) / total_time_delta);
-                    cpu_load.set_value(std::round(utilization));
-                    return true;
-                } else {
-                    Utils::log(Utils::LogSeverity::ERROR, "CpuMonitor: /proc/stat doesn't contain all the needed information");
-                    return false;
-                }
-            },
-            seconds);
+        : Glib::ObjectBase(typeid(CpuMonitor)), Monitor(seconds), cpu_load(*this, "cpu-load", 0.0), prev_idle_time(0), prev_total_time(0) {
+        reschedule();
     }
     std::vector<ProcessUtilization> get_processes_cpu_utilization(double seconds, int number = 10) const {
         pid_t pid = getpid();
@@ -132,6 +227,9 @@ public:
         size_t pid_time = 0;
         for (const auto d0 : data0) {
             ProcessCpuData d1 = get_cpu_data_from_file(d0.filename);
+            // The process exited between samples
+            if (d1.pid != d0.pid)
+                continue;
             size_t time = d1.utime + d1.stime + d1.cutime + d1.cstime -
                 d0.utime - d0.stime - d0.cutime - d0.cstime;
             if (time > 0) {
@@ -169,10 +267,48 @@ public:
     Glib::Property<double> cpu_load;
 
 private:
+    bool sample() override {
+        /*
+        https://docs.kernel.org/filesystems/proc.html
+        user: normal processes executing in user mode
+        nice: niced processes executing in user mode
+        system: processes executing in kernel mode
+        idle: twiddling thumbs
+        iowait: waiting for I/O to complete
+        irq: servicing interrupts
+        softirq: servicing softirqs
+        */
+
+        std::ifstream proc_stat("/proc/stat");
+        proc_stat.ignore(5, ' '); // Skip the 'cpu' prefix.
+
+        std::vector<size_t> times;
+        for (size_t time; proc_stat >> time; times.push_back(time))
+            ;
+
+        if (times.size() >= 4) {
+            auto idle_time = times[3];
+            // Accumulate only first four values, and skip IOWait, IRQ and SoftIRQ
+            auto total_time = std::accumulate(times.begin(), times.begin() + 4, 0);
+            const auto idle_time_delta = idle_time - prev_idle_time;
+            prev_idle_time = idle_time;
+            const auto total_time_delta = total_time - prev_total_time;
+            prev_total_time = total_time;
+            const double utilization = 100.0 * (1.0 - static_cast<double>(idle_time_delta) / total_time_delta);
+            cpu_load.set_value(std::round(utilization));
+            return true;
+        } else {
+            Utils::log(Utils::LogSeverity::ERROR, "CpuMonitor: /proc/stat doesn't contain all the needed information");
+            return false;
+        }
+    }
+
     ProcessCpuData get_cpu_data_from_file(const std::string &filename) const {
-        ProcessCpuData p;
+        ProcessCpuData p = {};
         p.filename = filename;
         std::ifstream proc_stat(filename);
+        if (!proc_stat)
+            return p;
         // https://docs.kernel.org/filesystems/proc.html
         proc_stat >> p.pid;
         // Parse p.name: it may contain spaces, so read everything between ()
@@ -210,23 +346,11 @@ private:
     std::vector<ProcessCpuData> get_processes_cpu_data() const {
         std::vector<ProcessCpuData> result;
 
-        // For every directory with a name that is a number (PID), load
-        // /proc/PID/stat
-        auto cwd = Gio::File::create_for_path("/proc");
-
-        auto files = cwd->enumerate_children(
-            "standard::*", Gio::FileQueryInfoFlags::NOFOLLOW_SYMLINKS);
-
-        for (auto fileinfo = files->next_file(); fileinfo != nullptr; fileinfo = files->next_file()) {
-            auto file = files->get_child(fileinfo);
-            if (file->query_file_type() == Gio::FileType::DIRECTORY) {
-                std::string s = file->get_basename();
-                if (!s.empty() && s.find_first_not_of("0123456789") == std::string::npos) {
-                    // Found a process directory
-                    ProcessCpuData p = get_cpu_data_from_file(file->get_path() + "/stat");
-                    result.push_back(p);
-                }
-            }
+        // For every live process, load /proc/PID/stat
+        for (auto pid : get_process_table().pids()) {
+            ProcessCpuData p = get_cpu_data_from_file(std::format("/proc/{}/stat", pid));
+            if (p.pid != 0)
+                result.push_back(p);
         }
         return result;
     }
@@ -244,7 +368,6 @@ private:
     }
 
     size_t prev_idle_time, prev_total_time;
-    sigc::connection timer;
 };
 
 static CpuMonitor *cpu_monitor = nullptr;
@@ -266,7 +389,7 @@ CpuGraph::CpuGraph(int seconds, int hist, const Color &col)
         });
 
     add_css_class("cpu-monitor");
-    drawing = Glib::make_refptr_for_instance(Gtk::make_managed<Graph>(cpu_monitor->cpu_load, history, color));
+    drawing = Glib::make_refptr_for_instance(Gtk::make_managed<Graph>(*cpu_monitor, cpu_monitor->cpu_load, history, color));
     button.set_child(*drawing);
     bind_property_changed(cpu_monitor, "cpu-load", [this]() {
         double d = cpu_monitor->cpu_load.get_value();
@@ -319,26 +442,13 @@ typedef struct {
     size_t mem_used;
 } ProcessMemData;
 
-class MemMonitor : public Glib::Object {
+class MemMonitor : public Monitor {
 public:
     MemMonitor(int seconds)
-        : Glib::ObjectBase(typeid(MemMonitor)),
+        : Glib::ObjectBase(typeid(MemMonitor)), Monitor(seconds),
           mem_load(*this, "memory-load", 0.0), mem_used(*this, "memory-used", 0),
           mem_available(0), mem_total(0) {
-        timer = Glib::signal_timeout().connect_seconds(
-            [this]() {
-                if (read_data()) {
-                    mem_load.set_value(std::round(
-                        (100.0 * (mem_total - mem_available)) / mem_total));
-                    mem_used.set_value(mem_total - mem_available);
-                    return true;
-                } else {
-                    mem_load.set_value(0.0);
-                    mem_used.set_value(0);
-                    return false;
-                }
-            },
-            seconds);
+        reschedule();
     }
     Glib::Property<double> mem_load;
     Glib::Property<size_t> mem_used;
@@ -346,38 +456,28 @@ public:
     std::vector<ProcessMemData> get_processes_mem_data(int number = 10) {
         std::vector<ProcessMemData> result;
 
-        // For every directory with a name that is a number (PID), load
-        // /proc/PID/status
-        auto cwd = Gio::File::create_for_path("/proc");
-
-        auto files = cwd->enumerate_children("standard::*", Gio::FileQueryInfoFlags::NOFOLLOW_SYMLINKS);
-
-        for (auto fileinfo = files->next_file(); fileinfo != nullptr; fileinfo = files->next_file()) {
-            auto file = files->get_child(fileinfo);
-            if (file->query_file_type() == Gio::FileType::DIRECTORY) {
-                std::string s = file->get_basename();
-                if (!s.empty() && s.find_first_not_of("0123456789") == std::string::npos) {
-                    // Found a process directory
-                    ProcessMemData p = { "", 0 };
-                    std::ifstream proc_status(file->get_path() + "/status");
-                    std::string line;
-                    while (getline(proc_status, line)) {
-                        std::istringstream ss(line);
-                        std::string field;
-                        ss >> field;
-                        if (field == "Name:") {
-                            ss >> p.name;
-                        } else if (field == "VmRSS:") {
-                            ss >> p.mem_used;
-                        }
-                        if (p.name != "" && p.mem_used > 0) {
-                            break;
-                        }
-                    }
-                    proc_status.close();
-                    result.push_back(p);
+        // For every live process, load /proc/PID/status
+        for (auto pid : get_process_table().pids()) {
+            ProcessMemData p = { "", 0 };
+            std::ifstream proc_status(std::format("/proc/{}/status", pid));
+            if (!proc_status)
+                continue;
+            std::string line;
+            while (getline(proc_status, line)) {
+                std::istringstream ss(line);
+                std::string field;
+                ss >> field;
+                if (field == "Name:") {
+                    ss >> p.name;
+                } else if (field == "VmRSS:") {
+                    ss >> p.mem_used;
+                }
+                if (p.name != "" && p.mem_used > 0) {
+                    break;
                 }
             }
+            proc_status.close();
+            result.push_back(p);
         }
         auto iter = result.end();
         auto size = result.size();
@@ -395,6 +495,19 @@ public:
     }
 
 private:
+    bool sample() override {
+        if (read_data()) {
+            mem_load.set_value(std::round(
+                (100.0 * (mem_total - mem_available)) / mem_total));
+            mem_used.set_value(mem_total - mem_available);
+            return true;
+        } else {
+            mem_load.set_value(0.0);
+            mem_used.set_value(0);
+            return false;
+        }
+    }
+
     bool read_data() {
         mem_total = 0;
         mem_available = 0;
@@ -417,7 +530,6 @@ private:
     }
 
     size_t mem_available, mem_total;
-    sigc::connection timer;
 };
 
 
@@ -430,7 +542,7 @@ MemGraph::MemGraph(int seconds, int hist, const Color &col)
         mem_monitor = new MemMonitor(seconds);
     }
     add_css_class("mem-monitor");
-    drawing = Glib::make_refptr_for_instance(Gtk::make_managed<Graph>(mem_monitor->mem_load, history, color));
+    drawing = Glib::make_refptr_for_instance(Gtk::make_managed<Graph>(*mem_monitor, mem_monitor->mem_load, history, color));
     button.set_child(*drawing);
     bind_property_changed(mem_monitor, "memory-load", [this]() {
         double d = mem_monitor->mem_load.get_value();
@@ -457,29 +569,13 @@ MemGraph::MemGraph(int seconds, int hist, const Color &col)
 
 // Nvidia GPU
 
-class GpuMonitor : public Glib::Object {
+class GpuMonitor : public Monitor {
 public:
     GpuMonitor(int seconds)
-        : Glib::ObjectBase(typeid(GpuMonitor)),
+        : Glib::ObjectBase(typeid(GpuMonitor)), Monitor(seconds),
           gpu_load(*this, "gpu-load", 0), gpu_mem_load(*this, "gpu-memory-load", 0.0), gpu_mem_used(*this, "gpu-memory-used", 0), gpu_mem_total(*this, "gpu-memory-total", 0),
           mem_used(0), mem_total(0) {
-        timer = Glib::signal_timeout().connect_seconds(
-            [this]() {
-                if (read_data()) {
-                    gpu_load.set_value(utilization);
-                    gpu_mem_load.set_value(std::round(100.0 * mem_used / mem_total));
-                    gpu_mem_used.set_value(mem_used);
-                    gpu_mem_total.set_value(mem_total);
-                    return true;
-                } else {
-                    gpu_load.set_value(0);
-                    gpu_mem_load.set_value(0.0);
-                    gpu_mem_used.set_value(0);
-                    gpu_mem_total.set_value(0);
-                    return false;
-                }
-            },
-            seconds);
+        reschedule();
     }
     Glib::Property<int> gpu_load;
     Glib::Property<double> gpu_mem_load;
@@ -487,6 +583,22 @@ public:
     Glib::Property<int> gpu_mem_total;
 
 private:
+    bool sample() override {
+        if (read_data()) {
+            gpu_load.set_value(utilization);
+            gpu_mem_load.set_value(std::round(100.0 * mem_used / mem_total));
+            gpu_mem_used.set_value(mem_used);
+            gpu_mem_total.set_value(mem_total);
+            return true;
+        } else {
+            gpu_load.set_value(0);
+            gpu_mem_load.set_value(0.0);
+            gpu_mem_used.set_value(0);
+            gpu_mem_total.set_value(0);
+            return false;
+        }
+    }
+
     bool read_data() {
         const auto stats = Utils::split(Utils::exec("nvidia-smi -i 0 --query-gpu=memory.total,memory.used,utilization.gpu --format=csv,noheader,nounits"), ",");
         if (stats.size() < 3) {
@@ -500,7 +612,6 @@ private:
     }
 
     int utilization, mem_used, mem_total;
-    sigc::connection timer;
 };
 
 static GpuMonitor *gpu_monitor = nullptr;
@@ -512,7 +623,7 @@ GpuGraph::GpuGraph(int seconds, int hist, const Color &col_gpu, const Color &col
         gpu_monitor = new GpuMonitor(seconds);
     }
     add_css_class("gpu-monitor");
-    drawing = Glib::make_refptr_for_instance(Gtk::make_managed<Graph>(gpu_monitor->gpu_mem_load, history, color_mem));
+    drawing = Glib::make_refptr_for_instance(Gtk::make_managed<Graph>(*gpu_monitor, gpu_monitor->gpu_mem_load, history, color_mem));
     button.set_child(*drawing);
     bind_property_changed(gpu_monitor, "gpu-memory-load", [this]() {
         double d = gpu_monitor->gpu_mem_load.get_value();
@@ -15,6 +15,7 @@
 #include "clock.h"
 #include "graph.h"
 #include "wireplumber.h"
+#include "notifications.h"
 #include "weather.h"
 #include "scroll.h"
 
@@ -273,6 +274,18 @@ Glib::RefPtr<GtkShell> GtkShell::create(const Glib::ustring &app_id)
     return Glib::make_refptr_for_instance<GtkShell>(new GtkShell(app_id));
 }
 
+// The notifications store is shared by all bars, so its limits are global
+static void set_notifications_limits(const json &limits)
+{
+    auto &server = NotificationsServer::get_instance();
+    size_t max_count, max_memory, max_resident;
+    server.get_limits(max_count, max_memory, max_resident);
+    max_count = limits.value("max-count", max_count);
+    max_memory = limits.value("max-memory-mib", max_memory / (1024 * 1024)) * 1024 * 1024;
+    max_resident = limits.value("max-resident", max_resident);
+    server.set_limits(max_count, max_memory, max_resident);
+}
+
 void GtkShell::on_activate()
 {
     // Parse json config and create bars
@@ -283,6 +296,12 @@ void GtkShell::on_activate()
     } catch (const json::parse_error& e) {
         Utils::log(Utils::LogSeverity::ERROR, std::format("message: {}\nexception id: {}\nbyte position of error: {}", e.what(), e.id, e.byte));
     }
+    // Either an array of bars, or an object with global settings and "bars"
+    if (json.is_object()) {
+        if (json.contains("notifications"))
+            set_notifications_limits(json["notifications"]);
+        json = json.value("bars", json::array());
+    }
     for (auto json_bar : json) {
         auto bar = new Bar(json_bar);
         GtkShellWindow *win = bar->get_window();
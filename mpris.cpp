@@ -2,6 +2,22 @@
 #include "mpris.h"
 #include "utils.h"
 
+#include <gdkmm/pixbuf.h>
+#include <gdkmm/pixbufloader.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+const std::string ART_CACHE_PATH = Utils::XDG_CACHE_HOME + "/gtkshell/art";
+// Thumbnail size in pixels
+const int ART_SIZE = 128;
+// Thumbnails kept on disk
+const size_t ART_CACHE_ENTRIES = 256;
+// Time before a URL that failed is fetched again
+const int64_t ART_RETRY_US = 10 * 60 * G_USEC_PER_SEC;
+
 Mpris &Mpris::get_instance()
 {
     // After C++11 this is thread safe. No two threads are allowed to enter a
@@ -13,46 +29,53 @@ Mpris &Mpris::get_instance()
 
 Mpris::Mpris()
 {
-    try {
-        auto connection = Gio::DBus::Connection::get_sync(Gio::DBus::BusType::SESSION);
-        proxy = Gio::DBus::Proxy::create_sync(connection, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus");
-
-        // The proxy's call method returns a tuple of the value(s) that the method
-        // call produces so just get the tuple as a VariantContainerBase.
-        const auto call_result = proxy->call_sync("ListNames");
-
-        // Now extract the single item in the variant container which is the
-        // array of strings (the names).
-        Glib::Variant<std::vector<Glib::ustring>> names_variant;
-        call_result.get_child(names_variant);
-
-        // Get the vector of strings.
-        auto names = names_variant.get();
-
-        for (const auto &busname : names) {
-            if (busname.find(PREFIX) == 0) {
-                add_player(busname);
-            }
-        }
-        proxy->signal_signal("NameOwnerChanged").connect([this](const Glib::ustring &, const Glib::ustring &, const Glib::VariantContainerBase &params) {
-            const Glib::ustring &name = params.get_child(0).get_dynamic<Glib::ustring>();
-            const Glib::ustring &old_owner = params.get_child(1).get_dynamic<Glib::ustring>();
-            const Glib::ustring &new_owner = params.get_child(2).get_dynamic<Glib::ustring>();
-            if (name.find(PREFIX) != 0)
+    // Nothing here blocks. Players are announced when their proxies are ready.
+    Gio::DBus::Proxy::create_for_bus(Gio::DBus::BusType::SESSION, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+        [this](Glib::RefPtr<Gio::AsyncResult> &result) {
+            try {
+                proxy = Gio::DBus::Proxy::create_for_bus_finish(result);
+            } catch (const Glib::Error &error) {
+                Utils::log(Utils::LogSeverity::ERROR, std::format("mpris: DBus: proxy to user session bus not available: {}", error.what()));
                 return;
-            if (new_owner != "" && old_owner == "") {
-                add_player(name);
-            } else if (old_owner != "" && new_owner == "") {
-                delete_player(name);
             }
-        });
-    } catch (const Gio::Error &error) {
-        Utils::log(Utils::LogSeverity::ERROR, std::format("mpris: DBus: proxy to user session bus not available: {}", error.what()));     
-    }
+            // Connect first, so no player is missed between ListNames and the signal
+            proxy->signal_signal("NameOwnerChanged").connect([this](const Glib::ustring &, const Glib::ustring &, const Glib::VariantContainerBase &params) {
+                const Glib::ustring &name = params.get_child(0).get_dynamic<Glib::ustring>();
+                const Glib::ustring &old_owner = params.get_child(1).get_dynamic<Glib::ustring>();
+                const Glib::ustring &new_owner = params.get_child(2).get_dynamic<Glib::ustring>();
+                if (name.find(PREFIX) != 0)
+                    return;
+                if (new_owner != "" && old_owner == "") {
+                    add_player(name);
+                } else if (old_owner != "" && new_owner == "") {
+                    delete_player(name);
+                }
+            });
+            proxy->call("ListNames",
+                [this](Glib::RefPtr<Gio::AsyncResult> &result) {
+                    try {
+                        // The proxy's call method returns a tuple of the value(s) that the method
+                        // call produces so just get the tuple as a VariantContainerBase.
+                        const auto call_result = proxy->call_finish(result);
+                        Glib::Variant<std::vector<Glib::ustring>> names_variant;
+                        call_result.get_child(names_variant);
+                        for (const auto &busname : names_variant.get()) {
+                            if (busname.find(PREFIX) == 0) {
+                                add_player(busname);
+                            }
+                        }
+                    } catch (const Glib::Error &error) {
+                        Utils::log(Utils::LogSeverity::ERROR, std::format("mpris: DBus: cannot list names: {}", error.what()));
+                    }
+                });
+        }, {}, Gio::DBus::ProxyFlags::DO_NOT_LOAD_PROPERTIES);
 }
 
 Mpris::~Mpris()
 {
+    for (auto player : pending) {
+        delete player.second;
+    }
     for (auto player : players) {
         delete player.second;
     }
@@ -62,20 +85,31 @@ void Mpris::add_player(const Glib::ustring &busname)
 {
     if (busname == "org.mpris.MediaPlayer2.playerctld")
         return;
+    if (players.contains(busname) || pending.contains(busname))
+        return;
 
+    // The player is pending until its proxies are ready
     Player *p = new Player(busname);
-    players[busname] = p;
+    pending[busname] = p;
+    p->appeared_signal.connect(
+        [this, p, busname]() {
+            pending.erase(busname);
+            players[busname] = p;
+            player_added_signal(p);
+        });
     p->closed_signal.connect(
         [this, p, busname]() {
-            players.erase(busname);
-            player_closed_signal(p);
+            // Players that never appeared were not announced
+            if (pending.erase(busname) == 0) {
+                players.erase(busname);
+                player_closed_signal(p);
+            }
             delete p;
         });
     p->changed_signal.connect(
         [this, busname]() {
             player_changed_signal(busname);
         });
-    player_added_signal(p);
 }
 
 void Mpris::delete_player(const Glib::ustring &busname)
@@ -83,23 +117,264 @@ void Mpris::delete_player(const Glib::ustring &busname)
     auto iter = players.find(busname);
     if (iter != players.end()) {
         iter->second->closed_signal();
+        return;
+    }
+    iter = pending.find(busname);
+    if (iter != pending.end()) {
+        iter->second->closed_signal();
     }
 }
 
-Player::Player(const Glib::ustring &busname)
+Player::Player(const Glib::ustring &busname) : available(false)
 {
     bus_name = busname.find("org.mpris.MediaPlayer2.") == 0 ?
         busname : "org.mpris.MediaPlayer2." + busname;
 
     name = Utils::split(bus_name, ".")[3];
+    art_connection = ArtCache::get_instance().signal_ready.connect(
+        [this](const Glib::ustring &url, const std::string &path) {
+            if (url == art_url && cover_art != path) {
+                cover_art = path;
+                changed_signal();
+            }
+        });
+    cancellable = Gio::Cancellable::create();
+    auto cancellable = this->cancellable;
+    // Each proxy loads all its properties with a single GetAll while it is
+    // created, after that we only read its cache
     Glib::RefPtr<Gio::DBus::InterfaceInfo> mpris_interface_info = Gio::DBus::NodeInfo::create_for_xml(DBUS_MPRIS_MEDIAPLAYER2)->lookup_interface("org.mpris.MediaPlayer2");
-    mpris_proxy = Gio::DBus::Proxy::create_for_bus_sync(Gio::DBus::BusType::SESSION, bus_name, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2", mpris_interface_info);
+    Gio::DBus::Proxy::create_for_bus(Gio::DBus::BusType::SESSION, bus_name, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2",
+        [this, cancellable](Glib::RefPtr<Gio::AsyncResult> &result) {
+            if (cancellable->is_cancelled())
+                return;
+            try {
+                mpris_proxy = Gio::DBus::Proxy::create_for_bus_finish(result);
+            } catch (const Glib::Error &error) {
+                on_proxy_error(error);
+                return;
+            }
+            on_proxy_ready();
+        }, cancellable, mpris_interface_info);
     Glib::RefPtr<Gio::DBus::InterfaceInfo> player_interface_info = Gio::DBus::NodeInfo::create_for_xml(DBUS_MPRIS_MEDIAPLAYER2_PLAYER)->lookup_interface("org.mpris.MediaPlayer2.Player");
-    player_proxy = Gio::DBus::Proxy::create_for_bus_sync(Gio::DBus::BusType::SESSION, bus_name, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player", player_interface_info);
-    player_proxy->signal_properties_changed().connect([this] (const Gio::DBus::Proxy::MapChangedProperties &changed, const std::vector<Glib::ustring> &invalidated) { sync(changed, invalidated); });
-    appeared_signal();
+    Gio::DBus::Proxy::create_for_bus(Gio::DBus::BusType::SESSION, bus_name, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player",
+        [this, cancellable](Glib::RefPtr<Gio::AsyncResult> &result) {
+            if (cancellable->is_cancelled())
+                return;
+            try {
+                player_proxy = Gio::DBus::Proxy::create_for_bus_finish(result);
+            } catch (const Glib::Error &error) {
+                on_proxy_error(error);
+                return;
+            }
+            player_proxy->signal_properties_changed().connect([this] (const Gio::DBus::Proxy::MapChangedProperties &changed, const std::vector<Glib::ustring> &invalidated) { sync(changed, invalidated); });
+            player_proxy->signal_signal("Seeked").connect([this](const Glib::ustring &, const Glib::ustring &, const Glib::VariantContainerBase &params) {
+                set_known_position(static_cast<double>(params.get_child(0).get_dynamic<int64_t>()) / 1000000);
+                changed_signal();
+            });
+            on_proxy_ready();
+        }, cancellable, player_interface_info);
+}
+
+Player::~Player()
+{
+    cancellable->cancel();
+    art_connection.disconnect();
+}
 
+void Player::update_cover_art()
+{
+    if (art_url == "") {
+        cover_art = "";
+        return;
+    }
+    cover_art = ArtCache::get_instance().lookup(art_url);
+}
+
+void Player::on_proxy_ready()
+{
+    if (!mpris_proxy || !player_proxy)
+        return;
     sync_all();
+    available = true;
+    appeared_signal();
+}
+
+void Player::on_proxy_error(const Glib::Error &error)
+{
+    Utils::log(Utils::LogSeverity::ERROR, std::format("mpris: DBus: cannot create proxy for {}: {}", bus_name.c_str(), error.what()));
+    // Stop the other proxy, and let Mpris delete us. Nothing can be
+    // touched after this.
+    cancellable->cancel();
+    closed_signal();
+}
+
+void Player::call(const Glib::RefPtr<Gio::DBus::Proxy> &proxy, const Glib::ustring &method,
+                  const Glib::VariantContainerBase &params, const std::function<void ()> &done)
+{
+    auto cancellable = this->cancellable;
+    proxy->call(method,
+        [this, proxy, method, cancellable, done](Glib::RefPtr<Gio::AsyncResult> &result) {
+            if (cancellable->is_cancelled())
+                return;
+            try {
+                proxy->call_finish(result);
+            } catch (const Glib::Error &error) {
+                Utils::log(Utils::LogSeverity::WARNING, std::format("mpris: DBus: {} failed for {}: {}", method.c_str(), bus_name.c_str(), error.what()));
+                reconcile();
+            }
+            if (done)
+                done();
+        }, cancellable, params);
+}
+
+void Player::set_playback_status(PlaybackStatus status)
+{
+    if (status == playback_status)
+        return;
+    // Freeze the position where it is now before changing the status
+    set_known_position(get_position());
+    playback_status = status;
+    changed_signal();
+}
+
+double Player::get_position() const
+{
+    if (playback_status != PlaybackStatus::PLAYING)
+        return position_base;
+    // A missing Rate means 1.0
+    auto r = rate > 0 ? rate : 1.0;
+    auto position = position_base + r * (Glib::get_monotonic_time() - position_time) / 1000000;
+    return length > 0 ? std::min(position, length) : position;
+}
+
+void Player::set_known_position(double pos)
+{
+    position_base = pos;
+    position_time = Glib::get_monotonic_time();
+    ++position_generation;
+}
+
+void Player::fetch_position()
+{
+    auto cancellable = this->cancellable;
+    auto generation = ++position_generation;
+    auto params = Glib::VariantContainerBase::create_tuple({
+        Glib::Variant<Glib::ustring>::create("org.mpris.MediaPlayer2.Player"),
+        Glib::Variant<Glib::ustring>::create("Position")
+    });
+    auto connection = player_proxy->get_connection();
+    connection->call("/org/mpris/MediaPlayer2", "org.freedesktop.DBus.Properties", "Get", params,
+        [this, connection, cancellable, generation](Glib::RefPtr<Gio::AsyncResult> &result) {
+            if (cancellable->is_cancelled())
+                return;
+            try {
+                auto response = connection->call_finish(result);
+                // Something else set the position meanwhile
+                if (generation != position_generation)
+                    return;
+                Glib::Variant<Glib::VariantBase> value;
+                response.get_child(value, 0);
+                set_known_position(static_cast<double>(value.get().get_dynamic<int64_t>()) / 1000000);
+                changed_signal();
+            } catch (const Glib::Error &error) {
+                Utils::log(Utils::LogSeverity::WARNING, std::format("mpris: DBus: cannot get position of {}: {}", bus_name.c_str(), error.what()));
+            } catch (const std::bad_cast &) {
+                Utils::log(Utils::LogSeverity::WARNING, std::format("mpris: DBus: invalid position from {}", bus_name.c_str()));
+            }
+        }, cancellable, bus_name);
+}
+
+void Player::reconcile()
+{
+    set_playback_status(PlaybackStatus(get_proxy_property<Glib::ustring>(player_proxy, "PlaybackStatus")));
+}
+
+void Player::raise()
+{
+    if (can_raise)
+        call(mpris_proxy, "Raise");
+}
+
+void Player::quit()
+{
+    if (can_quit)
+        call(mpris_proxy, "Quit");
+}
+
+void Player::next()
+{
+    if (can_go_next)
+        skip(1);
+}
+
+void Player::previous()
+{
+    if (can_go_previous)
+        skip(-1);
+}
+
+void Player::skip(int direction)
+{
+    // Clicks that arrive while a call is in flight are added up and sent
+    // when it returns. Opposite clicks cancel each other.
+    pending_skip += direction;
+    if (!skip_in_flight)
+        send_skip();
+}
+
+void Player::send_skip()
+{
+    if (pending_skip == 0)
+        return;
+    auto direction = pending_skip > 0 ? 1 : -1;
+    pending_skip -= direction;
+    skip_in_flight = true;
+    call(player_proxy, direction > 0 ? "Next" : "Previous", {},
+        [this]() {
+            skip_in_flight = false;
+            send_skip();
+        });
+}
+
+void Player::pause()
+{
+    if (can_pause) {
+        set_playback_status(PlaybackStatus::PAUSED);
+        call(player_proxy, "Pause");
+    }
+}
+
+void Player::play_pause()
+{
+    if (can_control) {
+        set_playback_status(playback_status == PlaybackStatus::PLAYING ? PlaybackStatus::PAUSED : PlaybackStatus::PLAYING);
+        call(player_proxy, "PlayPause");
+    }
+}
+
+void Player::stop()
+{
+    if (can_control) {
+        set_playback_status(PlaybackStatus::STOPPED);
+        call(player_proxy, "Stop");
+    }
+}
+
+void Player::play()
+{
+    if (can_control) {
+        set_playback_status(PlaybackStatus::PLAYING);
+        call(player_proxy, "Play");
+    }
+}
+
+void Player::set_position(double pos)
+{
+    // The track id is an object path, "(ox)"
+    auto params = Glib::Variant<std::tuple<Glib::DBusObjectPathString, int64_t>>::create({ Glib::DBusObjectPathString(trackid.raw()), static_cast<int64_t>(pos * 1000000) });
+    set_known_position(pos);
+    changed_signal();
+    call(player_proxy, "SetPosition", params);
 }
 
 void Player::sync_property(const Glib::ustring &name, const Glib::VariantBase &value)
@@ -116,8 +391,14 @@ void Player::sync_property(const Glib::ustring &name, const Glib::VariantBase &v
         loop_status = Loop(value.get_dynamic<Glib::ustring>());
     else if (name == "Shuffle")
         shuffle_status = value.get_dynamic<bool>();
-    else if (name == "PlaybackStatus")
-        playback_status = PlaybackStatus(value.get_dynamic<Glib::ustring>());
+    else if (name == "PlaybackStatus") {
+        auto status = PlaybackStatus(value.get_dynamic<Glib::ustring>());
+        if (status != playback_status) {
+            set_known_position(get_position());
+            playback_status = status;
+            resync_position = true;
+        }
+    }
     else if (name == "MinimumRate")
         minimum_rate = value.get_dynamic<double>();
     else if (name == "MaximumRate")
@@ -137,17 +418,26 @@ void Player::sync_property(const Glib::ustring &name, const Glib::VariantBase &v
     else if (name == "Metadata") {
         metadata = value.get_dynamic<std::map<std::string, Glib::VariantBase>>();
         if (metadata.size() > 0) {
+            length = -1;
             auto iter = metadata.find("mpris:length");
             if (iter != metadata.end()) {
                 auto t = iter->second.get_type().get_string();
                 if (t == "x" || t == "t") {
                     length = static_cast<double>(iter->second.get_dynamic<int64_t>()) / 1000000;
-                } else  {
-                    length = -1;
                 }
             }
-            trackid = get_str("mpris:trackid");
-            art_url = get_str("mpris:artUrl");
+            auto id = get_str("mpris:trackid");
+            if (id != trackid) {
+                // New tracks start at 0 until the player tells us otherwise
+                set_known_position(0);
+                resync_position = true;
+            }
+            trackid = id;
+            auto url = get_str("mpris:artUrl");
+            if (url != art_url) {
+                art_url = url;
+                update_cover_art();
+            }
             album = get_str("xesam:album");
             lyrics = get_str("xesam:asText");
             title = get_str("xesam:title");
@@ -156,17 +446,23 @@ void Player::sync_property(const Glib::ustring &name, const Glib::VariantBase &v
             comments = join_strv("xesam:comments", "\n");
             composer = join_strv("xesam:composer", ", ");
         }
-    } else if (name == "Rate")
+    } else if (name == "Rate") {
+        set_known_position(get_position());
         rate = value.get_dynamic<double>();
+        resync_position = true;
+    }
     else if (name == "Volume")
         volume = value.get_dynamic<double>();
 }
 
 void Player::sync(const Gio::DBus::Proxy::MapChangedProperties &changed, const std::vector<Glib::ustring> &invalidated)
 {
+    resync_position = false;
     for (auto property : changed) {
         sync_property(property.first, property.second);
     }
+    if (resync_position)
+        fetch_position();
     if (changed.size() > 0) {
         changed_signal();
         return;
@@ -205,6 +501,7 @@ void Player::sync_all()
         }
         trackid = get_str("mpris:trackid");
         art_url = get_str("mpris:artUrl");
+        update_cover_art();
         album = get_str("xesam:album");
         lyrics = get_str("xesam:asText");
         title = get_str("xesam:title");
@@ -215,5 +512,226 @@ void Player::sync_all()
     }
     rate = get_proxy_property<double>(player_proxy, "Rate");
     volume = get_proxy_property<double>(player_proxy, "Volume");
+    // The cache was just loaded, so it is the current position
+    set_known_position(static_cast<double>(get_proxy_property<int64_t>(player_proxy, "Position")) / 1000000);
     changed_signal();
 }
+
+ArtCache &ArtCache::get_instance()
+{
+    // After C++11 this is thread safe. No two threads are allowed to enter a
+    // variable declaration's initialization concurrently.
+    static ArtCache instance;
+
+    return instance;
+}
+
+ArtCache::ArtCache() : sem(0)
+{
+    dispatcher.connect([this]() {
+        mtx.lock();
+        auto ready = std::move(shared.ready);
+        shared.ready.clear();
+        mtx.unlock();
+        for (const auto &[url, path] : ready) {
+            requested.erase(url);
+            if (path == "") {
+                // Bounded like the cache, forget the oldest failure
+                if (failed.size() >= ART_CACHE_ENTRIES) {
+                    failed.erase(std::min_element(failed.begin(), failed.end(), [](const auto &a, const auto &b) {
+                        return a.second < b.second;
+                    }));
+                }
+                failed[url] = Glib::get_monotonic_time();
+            }
+            signal_ready.emit(url, path);
+        }
+    });
+    worker = std::make_shared<std::thread>(&ArtCache::work, this);
+}
+
+ArtCache::~ArtCache()
+{
+    mtx.lock();
+    shared.quit = true;
+    bool signaled = shared.signaled;
+    shared.signaled = true;
+    mtx.unlock();
+    if (!signaled)
+        sem.release();
+    worker->join();
+}
+
+std::string ArtCache::lookup(const Glib::ustring &url)
+{
+    const std::string path = ART_CACHE_PATH + "/" + Glib::Checksum::compute_checksum(Glib::Checksum::Type::SHA1, url.raw()) + ".png";
+    if (Glib::file_test(path, Glib::FileTest::EXISTS)) {
+        // Keeps it from being removed
+        queue({ Job::TOUCH, url, path });
+        return path;
+    }
+    auto failure = failed.find(url);
+    if (failure != failed.end()) {
+        if (Glib::get_monotonic_time() - failure->second < ART_RETRY_US)
+            return "";
+        failed.erase(failure);
+    }
+    if (!requested.contains(url)) {
+        requested.insert(url);
+        queue({ Job::FETCH, url, path });
+    }
+    return "";
+}
+
+void ArtCache::queue(Job &&job)
+{
+    mtx.lock();
+    shared.jobs.push_back(std::move(job));
+    bool signaled = shared.signaled;
+    shared.signaled = true;
+    mtx.unlock();
+    if (!signaled)
+        sem.release();
+}
+
+// Worker thread
+bool ArtCache::make_thumbnail(const Glib::ustring &url, const std::string &path)
+{
+    Glib::RefPtr<Gdk::Pixbuf> pixbuf;
+    try {
+        if (url.find("file://") == 0) {
+            pixbuf = Gdk::Pixbuf::create_from_file(Glib::filename_from_uri(url));
+        } else if (url.find("http://") == 0 || url.find("https://") == 0) {
+            auto data = Utils::fetch(url);
+            if (data.size() == 0)
+                return false;
+            auto loader = Gdk::PixbufLoader::create();
+            loader->write(data.data(), data.size());
+            loader->close();
+            pixbuf = loader->get_pixbuf();
+        } else {
+            Utils::log(Utils::LogSeverity::INFO, std::format("mpris: unsupported art URL {}", url.c_str()));
+            return false;
+        }
+    } catch (const Glib::Error &error) {
+        Utils::log(Utils::LogSeverity::WARNING, std::format("mpris: cannot load art {}: {}", url.c_str(), error.what()));
+        return false;
+    }
+    if (!pixbuf)
+        return false;
+    // Downsample keeping the aspect ratio, never upsample
+    auto width = pixbuf->get_width();
+    auto height = pixbuf->get_height();
+    if (width > ART_SIZE || height > ART_SIZE) {
+        auto scale = static_cast<double>(ART_SIZE) / std::max(width, height);
+        pixbuf = pixbuf->scale_simple(std::max(1, static_cast<int>(width * scale)), std::max(1, static_cast<int>(height * scale)), Gdk::InterpType::BILINEAR);
+    }
+    if (!Utils::ensure_directory(ART_CACHE_PATH))
+        return false;
+    try {
+        // Readers never see a partial file
+        const std::string tmp_path = path + ".tmp";
+        pixbuf->save(tmp_path, "png");
+        if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+            Utils::log(Utils::LogSeverity::WARNING, std::format("mpris: cannot rename art {}: {}", tmp_path, strerror(errno)));
+            return false;
+        }
+    } catch (const Glib::Error &error) {
+        Utils::log(Utils::LogSeverity::WARNING, std::format("mpris: cannot save art {}: {}", path, error.what()));
+        return false;
+    }
+    return true;
+}
+
+// Worker thread. The only directory scan, the modification times keep the
+// order between runs.
+void ArtCache::load_index()
+{
+    std::vector<std::pair<std::filesystem::file_time_type, std::string>> entries;
+    std::error_code error;
+    for (const auto &entry : std::filesystem::directory_iterator(ART_CACHE_PATH, error)) {
+        if (entry.is_regular_file(error) && entry.path().extension() == ".png")
+            entries.push_back({ entry.last_write_time(error), entry.path().string() });
+    }
+    std::sort(entries.begin(), entries.end());
+    for (const auto &entry : entries) {
+        files.push_front(entry.second);
+        index[entry.second] = files.begin();
+    }
+    trim();
+}
+
+// Worker thread. Marks path as the most recently used thumbnail.
+void ArtCache::use(const std::string &path)
+{
+    auto entry = index.find(path);
+    if (entry != index.end()) {
+        files.splice(files.begin(), files, entry->second);
+    } else {
+        files.push_front(path);
+        index[path] = files.begin();
+    }
+}
+
+// Worker thread. Removes the least recently used thumbnails.
+void ArtCache::trim()
+{
+    std::error_code error;
+    while (files.size() > ART_CACHE_ENTRIES) {
+        std::filesystem::remove(files.back(), error);
+        index.erase(files.back());
+        files.pop_back();
+    }
+}
+
+// Worker thread
+void ArtCache::work()
+{
+    load_index();
+    while (true) {
+        sem.acquire();
+        mtx.lock();
+        auto jobs = std::move(shared.jobs);
+        shared.jobs.clear();
+        shared.signaled = false;
+        bool quit = shared.quit;
+        mtx.unlock();
+        if (quit)
+            break;
+
+        std::vector<std::pair<Glib::ustring, std::string>> ready;
+        bool added = false;
+        for (auto &job : jobs) {
+            switch (job.type) {
+            case Job::FETCH:
+                if (make_thumbnail(job.url, job.path)) {
+                    use(job.path);
+                    added = true;
+                    ready.push_back({ job.url, job.path });
+                } else {
+                    // Let it be requested again
+                    ready.push_back({ job.url, "" });
+                }
+                break;
+            case Job::TOUCH: {
+                // It may have been trimmed since it was looked up
+                if (!index.contains(job.path))
+                    break;
+                use(job.path);
+                std::error_code error;
+                std::filesystem::last_write_time(job.path, std::filesystem::file_time_type::clock::now(), error);
+                break;
+            }
+            }
+        }
+        if (added)
+            trim();
+        if (ready.size() > 0) {
+            mtx.lock();
+            for (auto &item : ready)
+                shared.ready.push_back(std::move(item));
+            mtx.unlock();
+            dispatcher.emit();
+        }
+    }
+}
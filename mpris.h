@@ -2,11 +2,19 @@
 #define __GTKSHELL_MPRIS__
 
 #include <giomm.h>
+#include <glibmm.h>
 #include <glibmm/object.h>
 #include <glibmm/property.h>
 
 #include <unordered_map>
 #include <any>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <semaphore>
+#include <set>
+#include <thread>
 
 class PlaybackStatus {
 public:
@@ -119,56 +127,97 @@ private:
 };
 
 
+// Album art thumbnails. A worker reads file:// and fetches http(s):// URLs,
+// downsamples them and keeps them on disk as PNG, named after the URL hash.
+// The least recently used thumbnails are removed.
+class ArtCache {
+public:
+    static ArtCache &get_instance();
+
+    // Avoid copy creation
+    ArtCache(const ArtCache &) = delete;
+    void operator=(const ArtCache &) = delete;
+
+    // Returns the path of the thumbnail if it is cached. Otherwise returns ""
+    // and emits signal_ready when it is.
+    std::string lookup(const Glib::ustring &url);
+
+    sigc::signal<void(const Glib::ustring &url, const std::string &path)> signal_ready;
+
+private:
+    ArtCache();
+    ~ArtCache();
+
+    typedef struct {
+        enum {
+            FETCH,
+            TOUCH
+        } type;
+        Glib::ustring url;
+        std::string path;
+    } Job;
+
+    void queue(Job &&job);
+    void work();
+    bool make_thumbnail(const Glib::ustring &url, const std::string &path);
+    void load_index();
+    void use(const std::string &path);
+    void trim();
+
+    // URLs being fetched
+    std::set<Glib::ustring> requested;
+    // URLs that failed, by time of failure. They are not fetched again
+    // until ART_RETRY_US has passed.
+    std::map<Glib::ustring, int64_t> failed;
+
+    // Worker only. Thumbnails on disk, most recently used at the front.
+    // Built from the directory at startup, kept up to date after that.
+    std::list<std::string> files;
+    std::unordered_map<std::string, std::list<std::string>::iterator> index;
+
+    struct {
+        std::vector<Job> jobs;
+        std::vector<std::pair<Glib::ustring, std::string>> ready;
+        bool signaled = false;
+        bool quit = false;
+    } shared;
+    std::mutex mtx;
+    std::binary_semaphore sem;
+    Glib::Dispatcher dispatcher;
+    std::shared_ptr<std::thread> worker;
+};
+
 class Player : public Glib::Object {
 public:
     Player(const Glib::ustring &busname);
+    ~Player();
 
     Glib::ustring bus_name;
     Glib::ustring name;
     bool available;
 
+    // Emitted once, when the proxies are ready and the properties loaded
     sigc::signal<void ()> appeared_signal;
     sigc::signal<void ()> closed_signal; 
     sigc::signal<void ()> changed_signal; 
 
-    void raise() {
-        if (can_raise)
-            mpris_proxy->call_sync("Raise");
-    }
-    void quit() {
-        if (can_quit)
-            mpris_proxy->call_sync("Quit");
-    }
+    // None of the controls block. Playback status changes are shown
+    // immediately, PropertiesChanged from the player has the final word.
+    void raise();
+    void quit();
 
     bool can_raise;
     bool can_quit;
     bool has_track_list;
     Glib::ustring identity;
 
-    void next() {
-        if (can_go_next)
-            player_proxy->call_sync("Next");
-    }
-    void previous() {
-        if (can_go_previous)
-            player_proxy->call_sync("Previous");
-    }
-    void pause() {
-        if (can_pause)
-            player_proxy->call_sync("Pause");
-    }
-    void play_pause() {
-        if (can_control)
-            player_proxy->call_sync("PlayPause");
-    }
-    void stop() {
-        if (can_control)
-            player_proxy->call_sync("Stop");
-    }
-    void play() {
-        if (can_control)
-            player_proxy->call_sync("Play");
-    }
+    // Repeated clicks on next and previous are coalesced
+    void next();
+    void previous();
+    void pause();
+    void play_pause();
+    void stop();
+    void play();
     void loop() {
         if (Loop::UNSUPPORTED)
             return;
@@ -216,13 +265,10 @@ public:
         volume = vol;
     }
 
-    double get_position() {
-        return static_cast<double>(get_proxy_property<int64_t>(player_proxy, "Position")) / 1000000;
-    }
-    void set_position(double pos) {
-        auto params = Glib::Variant<std::tuple<Glib::ustring, int64_t>>::create({ trackid, static_cast<int64_t>(pos * 1000000) });
-        player_proxy->call_sync("SetPosition", params);
-    }
+    // Position doesn't emit changes, so it is extrapolated from the last
+    // known one. There is no D-Bus traffic while the playback is steady.
+    double get_position() const;
+    void set_position(double pos);
 
     PlaybackStatus playback_status;
     double minimum_rate;
@@ -235,7 +281,7 @@ public:
     bool can_control;
     std::map<std::string, Glib::VariantBase> metadata;
     Glib::ustring trackid;
-    double length;
+    double length = -1;
     Glib::ustring art_url;  // url of the cover art. Use cover_art if available
     Glib::ustring album;
     Glib::ustring album_artist;  // artist of the current album
@@ -244,7 +290,7 @@ public:
     Glib::ustring title;
     Glib::ustring composer;
     Glib::ustring comments;
-    Glib::ustring cover_art;  // path of the cached art_url
+    Glib::ustring cover_art;  // path of the cached art_url, "" until it is ready
 
     std::any get_meta(const Glib::ustring &key) {
         auto iter = metadata.find(key);
@@ -290,6 +336,30 @@ private:
 
     Glib::RefPtr<Gio::DBus::Proxy> mpris_proxy;
     Glib::RefPtr<Gio::DBus::Proxy> player_proxy;
+    // Cancels the proxy creation if the player goes away
+    Glib::RefPtr<Gio::Cancellable> cancellable;
+    sigc::connection art_connection;
+    void update_cover_art();
+    void on_proxy_ready();
+    // Asynchronous call, on error the state is taken again from the proxy cache
+    void call(const Glib::RefPtr<Gio::DBus::Proxy> &proxy, const Glib::ustring &method,
+              const Glib::VariantContainerBase &params = {}, const std::function<void ()> &done = nullptr);
+    void set_playback_status(PlaybackStatus status);
+    void reconcile();
+    void skip(int direction);
+    void send_skip();
+    // Last known position in seconds, and when it was known
+    double position_base = 0;
+    gint64 position_time = 0;
+    // Incremented whenever the position is set, so older replies are ignored
+    uint32_t position_generation = 0;
+    void set_known_position(double pos);
+    void fetch_position();
+    bool resync_position = false;
+    // Net number of tracks to skip, negative is backwards
+    int pending_skip = 0;
+    bool skip_in_flight = false;
+    void on_proxy_error(const Glib::Error &error);
     void sync_property(const Glib::ustring &name, const Glib::VariantBase &value);
     void sync(const Gio::DBus::Proxy::MapChangedProperties &changed, const std::vector<Glib::ustring> &invalidated);
     void sync_all();
@@ -307,6 +377,7 @@ public:
     sigc::signal<void (Player *)> player_closed_signal;
     sigc::signal<void (const Glib::ustring &bus)> player_changed_signal;
 
+    // Players whose proxies are ready
     std::unordered_map<std::string, Player *> players;
 
 private:
@@ -316,6 +387,8 @@ private:
     void add_player(const Glib::ustring &busname);
     void delete_player(const Glib::ustring &busname);
 
+    // Players still creating their proxies
+    std::unordered_map<std::string, Player *> pending;
     const std::string PREFIX = "org.mpris.MediaPlayer2.";
     Glib::RefPtr<Gio::DBus::Proxy> proxy;
 };
@@ -4,8 +4,13 @@
 #include <giomm.h>
 #include <glibmm.h>
 #include <unordered_map>
+#include <list>
+#include <cstring>
 #include <thread>
 #include <semaphore>
+#include <atomic>
+#include <map>
+#include <mutex>
 
 #include <nlohmann/json.hpp>
 using json = nlohmann::json;
@@ -79,11 +84,117 @@ private:
     Enum e;
 };
 
+// https://docs.gtk.org/glib/gvariant-format-strings.html
+// https://specifications.freedesktop.org/notification-spec/latest/hints.html
+
+// (iiibiiay)
+// width, height, rowstride, has alpha, bits per sample, channels and image data
+typedef struct {
+    int32_t w, h;
+    int32_t rs;
+    bool alpha;
+    int32_t bps;
+    int32_t channels;
+} ImageHeader;
+
+// Content-addressed cache for the images sent in image-data hints.
+// Images are named after the hash of their pixels, so an avatar resent with
+// every message is stored once. PNG encoding happens in a worker thread, and
+// files are removed when no notification references them anymore.
+// Except for the worker, everything runs in the main thread.
+class NotificationImageCache {
+public:
+    static NotificationImageCache &get_instance();
+
+    // Avoid copy creation
+    NotificationImageCache(const NotificationImageCache &) = delete;
+    void operator=(const NotificationImageCache &) = delete;
+
+    // Returns the path the image will have, and holds a reference to it
+    std::string add(const ImageHeader &header, std::vector<uint8_t> &&data);
+    // Reference counting for paths. Paths outside the cache are ignored
+    void ref(const std::string &path);
+    void unref(const std::string &path);
+    // False while the image is still being encoded, or if encoding failed
+    bool is_ready(const std::string &path) const;
+    bool is_failed(const std::string &path) const;
+    // Remove the files nobody references, call after loading notifications
+    void sweep();
+    // Finish pending work and stop removing files (we are shutting down)
+    void stop();
+
+    sigc::signal<void(const std::string &)> signal_ready;
+    // The image couldn't be written, users should keep their fallback
+    sigc::signal<void(const std::string &)> signal_failed;
+
+private:
+    NotificationImageCache();
+    ~NotificationImageCache();
+
+    struct Job;
+    typedef struct {
+        uint32_t refs;
+        bool ready;
+        bool failed;
+    } Entry;
+
+    bool owns(const std::string &path) const;
+    void queue(Job &&job);
+    void work();
+
+    std::unordered_map<std::string, Entry> entries;
+    bool stopped = false;
+
+    struct {
+        std::vector<Job> jobs;
+        std::vector<std::string> ready;
+        std::vector<std::string> failed;
+        bool signaled = false;
+        bool quit = false;
+    } shared;
+    std::mutex mtx;
+    std::binary_semaphore sem;
+    Glib::Dispatcher dispatcher;
+    std::shared_ptr<std::thread> worker;
+};
+
+// String interned by GLib. Values that repeat across notifications, like the
+// application name, share one copy, and copying is copying a pointer.
+// Interned strings are never freed.
+class InternedString {
+public:
+    InternedString() : str(g_intern_static_string("")) {}
+    InternedString(const Glib::ustring &string) : str(g_intern_string(string.c_str())) {}
+
+    operator Glib::ustring() const { return str; }
+    const char *c_str() const { return str; }
+    std::string raw() const { return str; }
+
+    bool operator==(const InternedString &other) const { return str == other.str; }
+    bool operator==(const char *other) const { return strcmp(str, other) == 0; }
+
+private:
+    const char *str;
+};
+
 class Notification {
 public:
     Notification(const Glib::ustring &app_name, uint32_t id, const Glib::ustring &app_icon,
                  const Glib::ustring &summary, const Glib::ustring &body,
                  const std::vector<Glib::ustring> &actions, const std::map<Glib::ustring, Glib::VariantBase> &hints, int32_t expire_timeout);
+    ~Notification();
+
+    // Avoid copy creation, it would release the image twice
+    Notification(const Notification &) = delete;
+    void operator=(const Notification &) = delete;
+
+    // Notifications come and go all the time and have the same size, they
+    // are allocated from a pool
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr, size_t size);
+
+    // Approximate heap usage, not counting interned strings
+    size_t memory_usage() const;
 
     static Notification *from_json(const json &j);
     json to_json() const;
@@ -92,9 +203,9 @@ public:
     void close();
     void invoke(const Glib::ustring &id);
 
-    Glib::ustring app_name;
+    InternedString app_name;
     uint32_t id = 0;
-    Glib::ustring app_icon;
+    InternedString app_icon;
     Glib::ustring summary;
     Glib::ustring body;
     std::vector<Action> actions;
@@ -103,7 +214,7 @@ public:
     // Coming from hints
     bool action_icons = false;
     Glib::ustring category;
-    Glib::ustring desktop_entry;
+    InternedString desktop_entry;
     Glib::ustring image_path;
     bool resident = false;
     Glib::ustring sound_file;
@@ -115,6 +226,12 @@ public:
 
     uint64_t time = 0;
     bool popup;
+    // Number of notifications coalesced into this one
+    uint32_t count = 1;
+
+    // Bookkeeping of NotificationsServer
+    size_t size = 0;
+    std::list<Notification *>::iterator lru;
 
 private:
     Notification();
@@ -122,6 +239,30 @@ private:
     Glib::ustring parse_image_data(const Glib::VariantBase &var);
 };
 
+// Inverted index of the words in the application name, summary and body of
+// notifications. Words are lower case, queries match word prefixes, and
+// all the words in a query must match.
+class NotificationsIndex {
+public:
+    static Glib::ustring text(const Notification *n);
+    static Glib::ustring text(const json &notification);
+
+    void add(uint32_t id, const Glib::ustring &text);
+    void remove(uint32_t id, const Glib::ustring &text);
+    void clear() { words.clear(); }
+    // Sorted ids of the matching notifications
+    std::vector<uint32_t> search(const Glib::ustring &query) const;
+
+    json to_json() const;
+    void from_json(const json &j);
+
+private:
+    static std::vector<std::string> tokenize(const Glib::ustring &text);
+
+    // Word -> sorted ids
+    std::map<std::string, std::vector<uint32_t>> words;
+};
+
 // https://specifications.freedesktop.org/notification-spec/latest/
 // https://dbus.freedesktop.org/doc/dbus-tutorial.html#concepts
 class NotificationsServer : public Glib::Object {
@@ -143,6 +284,25 @@ public:
     void invoke_notification(uint32_t id, const Glib::ustring &action_id);
     void clear_notifications();
 
+    // Bytes written to the cache (journal and snapshots) since startup
+    uint64_t cache_bytes_written() const { return bytes_written; }
+
+    // When any of the limits is exceeded, the least recently used
+    // notifications that are not resident are closed. Resident ones are
+    // closed when there are more than max_resident, or when closing the
+    // others is not enough.
+    void set_limits(size_t max_count, size_t max_memory, size_t max_resident);
+    void get_limits(size_t &max_count, size_t &max_memory, size_t &max_resident) const {
+        max_count = this->max_count;
+        max_memory = this->max_memory;
+        max_resident = this->max_resident;
+    }
+    // Approximate memory used by the stored notifications
+    size_t memory_usage() const { return memory; }
+
+    // Sorted ids of the notifications matching query
+    std::vector<uint32_t> search(const Glib::ustring &query) const { return index.search(query); }
+
     // there is a notifications server running, either us or someone else
     Glib::Property<bool> server_available;
 
@@ -150,6 +310,15 @@ public:
     Glib::Property<bool> notifications_popup;
     std::unordered_map<int, Notification *> notifications;
 
+    // Item deltas, so views can update incrementally.
+    // signal_updated is emitted when a notification is replaced (the pointer
+    // changes) or dismissed (popup changes). signal_removed is emitted before
+    // the notification is deleted.
+    sigc::signal<void(Notification *)> signal_added;
+    sigc::signal<void(Notification *)> signal_updated;
+    sigc::signal<void(uint32_t)> signal_removed;
+    sigc::signal<void()> signal_cleared;
+
 private:
     NotificationsServer();
     virtual ~NotificationsServer();
@@ -163,7 +332,31 @@ private:
     void notify_method(const Glib::RefPtr<Gio::DBus::Connection> &connection, const Glib::VariantContainerBase& parameters, const Glib::RefPtr<Gio::DBus::MethodInvocation>& invocation);
     void close_notification_method(const Glib::RefPtr<Gio::DBus::Connection> &connection, const Glib::VariantContainerBase &parameters, const Glib::RefPtr<Gio::DBus::MethodInvocation> &invocation);
 
-    void save_notifications() const;
+    // Cache persistence. The cache is a snapshot plus an append-only journal
+    // of add/close/clear records, replayed at startup. Records are
+    // batched on the main thread for SAVE_DELAY_MS and appended by a worker,
+    // which compacts the journal into a new snapshot once it grows past
+    // JOURNAL_COMPACT_SIZE.
+    void load_notifications();
+    void journal(json &&record);
+    void flush_journal();
+    void write_journal();
+    void compact_journal();
+    static bool persistent(const Notification *n) { return n->resident && !n->transient; }
+
+    void apply_policy(Notification *n, const Notification *replaced);
+    static std::string group_key(const Notification *n);
+    // Drops the group of a closed notification if it was its leader
+    void forget_group(const Notification *n);
+    // Drops token buckets that have been full for a while
+    void prune_buckets(int64_t now);
+    void track(Notification *n, bool indexed = false);
+    void untrack(Notification *n);
+    void touch(Notification *n);
+    // keep is the notification that caused the check, it is never closed
+    void enforce_limits(uint32_t keep = 0);
+    bool evict(const std::list<Notification *> &list, uint32_t keep);
+    void notify_changed();
 
     void disconnect_expiration_timer(uint32_t id);
     void send_closed_notification_signal(uint32_t id, NotificationCloseReason reason);
@@ -171,12 +364,67 @@ private:
     const std::string DBUS_NAME = "org.freedesktop.Notifications";
     Glib::RefPtr<Gio::DBus::Proxy> proxy;
     Glib::RefPtr<Gio::DBus::ObjectSkeleton> dbus;
+    // Session bus connection, set when the bus is acquired
+    Glib::RefPtr<Gio::DBus::Connection> connection;
 
     guint dbus_name_id;
     guint dbus_registered_id;
     uint32_t id_count;
 
     std::unordered_map<int, sigc::connection> expiration_timers;
+
+    // Store limits. Notifications that are not resident are in lru and are
+    // evicted first, resident ones are in resident_lru. Most recent at the
+    // front.
+    size_t max_count = 1000;
+    size_t max_memory = 16 * 1024 * 1024;
+    size_t max_resident = 500;
+    size_t memory = 0;
+    std::list<Notification *> lru;
+    std::list<Notification *> resident_lru;
+    std::list<Notification *> &lru_list(const Notification *n) { return n->resident ? resident_lru : lru; }
+
+    NotificationsIndex index;
+
+    // Storm control
+    static constexpr int64_t COALESCE_WINDOW_US = 10 * G_USEC_PER_SEC;
+    static constexpr double POPUP_BURST = 5.0;
+    // Popups per second once the burst is used
+    static constexpr double POPUP_RATE = 0.5;
+    // Buckets are checked for pruning at most this often
+    static constexpr int64_t BUCKET_PRUNE_US = 60 * G_USEC_PER_SEC;
+    static const unsigned int NOTIFY_DELAY_MS = 16;
+    typedef struct {
+        uint32_t leader = 0;
+        int64_t time = 0;
+    } Group;
+    typedef struct {
+        double tokens;
+        int64_t time;
+    } TokenBucket;
+    // By application and category
+    std::unordered_map<std::string, Group> groups;
+    // By application
+    std::unordered_map<std::string, TokenBucket> buckets;
+    int64_t buckets_pruned = 0;
+    sigc::connection notify_timer;
+
+    static const unsigned int SAVE_DELAY_MS = 500;
+    static const size_t JOURNAL_COMPACT_SIZE = 256 * 1024;
+    sigc::connection save_timer;
+    std::vector<json> journal_pending;
+    struct {
+        std::vector<json> records;
+        bool signaled = false;
+        bool quit = false;
+    } shared_save;
+    std::mutex save_mtx;
+    std::binary_semaphore save_sem;
+    std::shared_ptr<std::thread> saver;
+    // Only used by the worker after construction
+    std::map<uint32_t, json> journal_state;
+    size_t journal_size = 0;
+    std::atomic<uint64_t> bytes_written = 0;
 };
 
 class NotificationsClient {
@@ -186,21 +434,20 @@ public:
     NotificationsClient(const NotificationsServer &) = delete;
     void operator=(const NotificationsServer &) = delete;
 
-    // For external: Utils::notify()
+    // For external: Utils::notify(). Never blocks, it can be called from any
+    // thread. If the queue is full, the notification is dropped.
     void add_notification(const Glib::ustring &app_name, const Glib::ustring &app_icon,
                           const Glib::ustring &summary, const Glib::ustring &body);
 
+    // Notifications waiting to be sent
+    size_t queue_depth() const { return depth.load(std::memory_order_relaxed); }
+    // Notifications dropped because the queue was full
+    uint64_t dropped() const { return dropped_count.load(std::memory_order_relaxed); }
+
 private:
     NotificationsClient();
     virtual ~NotificationsClient();
 
-    void send_notifications();
-    void dispatch_notification(const Glib::ustring &app_name, const Glib::ustring &app_icon,
-                               const Glib::ustring &summary, const Glib::ustring &body);
-
-    Glib::RefPtr<Gio::DBus::Proxy> proxy;
-    const std::string DBUS_NAME = "org.freedesktop.Notifications";
-
     typedef struct {
         Glib::ustring app_name;
         Glib::ustring app_icon;
@@ -208,8 +455,32 @@ private:
         Glib::ustring body;
     } SimpleNotification;
 
-    SimpleNotification notification;
-    std::binary_semaphore sem_pro, sem_con;
+    struct QueuedNotification {
+        SimpleNotification notification;
+        QueuedNotification *next;
+    };
+
+    void send_notifications();
+    // Takes all the queued notifications, oldest first
+    std::vector<SimpleNotification> take_notifications();
+    void send_notification(const SimpleNotification &notification);
+
+    // Tuning
+    static constexpr size_t MAX_QUEUE_DEPTH = 256;
+
+    const std::string DBUS_NAME = "org.freedesktop.Notifications";
+    // Only used by the worker
+    Glib::RefPtr<Gio::DBus::Proxy> proxy;
+
+    // Multiple producers push, the worker takes the whole stack at once
+    std::atomic<QueuedNotification *> head = nullptr;
+    std::atomic<size_t> depth = 0;
+    std::atomic<uint64_t> dropped_count = 0;
+    // Incremented on every push, the worker waits on it
+    std::atomic<uint32_t> pushed = 0;
+    // Set when a notifications server owns the name
+    std::atomic<bool> ready = false;
+    std::atomic<bool> quit = false;
     std::shared_ptr<std::thread> worker;
 };
 
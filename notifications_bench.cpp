@@ -0,0 +1,309 @@
+// Load benchmark for NotificationsServer
+//
+// Starts a private session bus and an empty cache directory, and runs itself
+// again in that environment (the cache paths are fixed at startup). The child
+// runs the server without any UI and sends bursts of Notify calls to it
+// through the bus, like any other client would.
+//
+// It also fills a NotificationsIndex and times prefix and multi word
+// searches on it.
+//
+// notifications_bench [-b bursts] [-n burst size] [-i images] [-p image size] [-w ms] [-x entries]
+// -b number of bursts (default = 10)
+// -n notifications per burst (default = 100)
+// -i number of different image-data hints to cycle through, 0 = no images (default = 0)
+// -p image width and height in pixels (default = 64)
+// -w wait between bursts in ms (default = 100)
+// -x entries in the search index benchmark, 0 = skip it (default = 10000)
+
+#include "notifications.h"
+#include "utils.h"
+
+#include <giomm.h>
+#include <glibmm.h>
+#include <gtkmm/application.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <random>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+    int bursts = 10;
+    int burst_size = 100;
+    int images = 0;
+    int image_size = 64;
+    int wait = 100;
+    int index_entries = 10000;
+    bool child = false;
+} Options;
+
+typedef std::tuple<int32_t, int32_t, int32_t, bool, int32_t, int32_t, std::vector<uint8_t>> ImageData;
+
+static bool parse_options(int argc, char **argv, Options &options)
+{
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--child") == 0) {
+            options.child = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            return false;
+        if (strcmp(argv[i], "-b") == 0) {
+            options.bursts = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0) {
+            options.burst_size = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-i") == 0) {
+            options.images = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0) {
+            options.image_size = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0) {
+            options.wait = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-x") == 0) {
+            options.index_entries = std::atoi(argv[++i]);
+        } else {
+            return false;
+        }
+    }
+    return options.bursts > 0 && options.burst_size > 0 && options.images >= 0 && options.image_size > 0 && options.wait >= 0 && options.index_entries >= 0;
+}
+
+static size_t resident_memory()
+{
+    size_t size = 0, resident = 0;
+    auto statm = Utils::read_file("/proc/self/statm");
+    if (sscanf(statm.c_str(), "%zu %zu", &size, &resident) != 2)
+        return 0;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void run_for(int ms)
+{
+    bool done = false;
+    Glib::signal_timeout().connect_once([&done]() { done = true; }, ms);
+    auto context = Glib::MainContext::get_default();
+    while (!done)
+        context->iteration(true);
+}
+
+static Glib::VariantContainerBase notify_parameters(int n, const std::vector<Glib::VariantBase> &images)
+{
+    std::map<Glib::ustring, Glib::VariantBase> hints;
+    // Resident notifications are persisted, so we measure the cache too
+    hints["resident"] = Glib::Variant<bool>::create(true);
+    if (images.size() > 0)
+        hints["image-data"] = images[n % images.size()];
+    return Glib::VariantContainerBase::create_tuple({
+        Glib::Variant<Glib::ustring>::create("notifications_bench"),
+        Glib::Variant<uint32_t>::create(0),
+        Glib::Variant<Glib::ustring>::create(""),
+        Glib::Variant<Glib::ustring>::create(std::format("Notification {}", n)),
+        Glib::Variant<Glib::ustring>::create(std::format("Body of notification {}, sent by the benchmark", n)),
+        Glib::Variant<std::vector<Glib::ustring>>::create({}),
+        Glib::Variant<std::map<Glib::ustring, Glib::VariantBase>>::create(hints),
+        Glib::Variant<int32_t>::create(-1)
+    });
+}
+
+// Searches are typed interactively, they should take well under a frame
+static const double SEARCH_TARGET_MS = 1.0;
+static const int SEARCH_REPEAT = 100;
+
+static double time_search(const NotificationsIndex &index, const Glib::ustring &query, size_t &matches)
+{
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < SEARCH_REPEAT; ++i)
+        matches = index.search(query).size();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / SEARCH_REPEAT;
+}
+
+static void run_index(const Options &options)
+{
+    static const std::vector<std::string> APPS = {
+        "firefox", "thunderbird", "discord", "slack", "signal", "telegram", "spotify", "steam", "transmission", "evolution"
+    };
+    static const std::vector<std::string> WORDS = {
+        "message", "meeting", "download", "completed", "update", "available", "battery", "low", "network", "connected",
+        "disconnected", "reminder", "calendar", "event", "playing", "paused", "friend", "request", "new", "mail"
+    };
+    // Always the same contents, so runs can be compared
+    std::mt19937 random(1);
+    NotificationsIndex index;
+    const auto start = std::chrono::steady_clock::now();
+    for (int id = 1; id <= options.index_entries; ++id) {
+        std::string text = APPS[random() % APPS.size()];
+        for (int w = 0; w < 6; ++w)
+            text += " " + WORDS[random() % WORDS.size()];
+        text += std::format(" item{}", id);
+        index.add(id, text);
+    }
+    const double fill = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::format("index: {} entries filled in {:.1f} ms\n", options.index_entries, fill);
+
+    // A short prefix matching many words, a word, intersections of two and
+    // three words, and a prefix of all the unique words
+    for (const auto &query : { "d", "mess", "firefox download", "meeting reminder calendar", "item" }) {
+        size_t matches = 0;
+        const double ms = time_search(index, query, matches);
+        std::cout << std::format("index search \"{}\": {} matches, {:.3f} ms{}\n", query, matches, ms,
+                                 ms < SEARCH_TARGET_MS ? "" : std::format(" (over {:.1f} ms)", SEARCH_TARGET_MS));
+    }
+}
+
+static int run_child(const Options &options)
+{
+    // Initializes the gtkmm wrappers (the image cache uses Gdk::Pixbuf).
+    // The application is never registered, so no display is needed.
+    auto app = Gtk::Application::create("com.github.dawsers.gtkshell.bench", Gio::Application::Flags::NON_UNIQUE);
+    auto context = Glib::MainContext::get_default();
+
+    auto &server = NotificationsServer::get_instance();
+    while (!server.server_available.get_value())
+        context->iteration(true);
+
+    // A connection of our own, so calls go through the bus
+    Glib::RefPtr<Gio::DBus::Connection> connection;
+    try {
+        connection = Gio::DBus::Connection::create_for_address_sync(Glib::getenv("DBUS_SESSION_BUS_ADDRESS"),
+            Gio::DBus::ConnectionFlags::AUTHENTICATION_CLIENT | Gio::DBus::ConnectionFlags::MESSAGE_BUS_CONNECTION);
+    } catch (const Glib::Error &error) {
+        Utils::log(Utils::LogSeverity::ERROR, std::format("notifications_bench: cannot connect to the bus: {}", error.what()));
+        return 1;
+    }
+
+    std::vector<Glib::VariantBase> images;
+    for (int i = 0; i < options.images; ++i) {
+        const int32_t size = options.image_size;
+        std::vector<uint8_t> pixels(size * size * 4);
+        for (size_t p = 0; p < pixels.size(); ++p)
+            pixels[p] = (p * (i + 1)) & 0xff;
+        images.push_back(Glib::Variant<ImageData>::create({ size, size, size * 4, true, 8, 4, pixels }));
+    }
+
+    const size_t rss_start = resident_memory();
+    std::vector<double> latencies;
+    latencies.reserve(options.bursts * options.burst_size);
+    std::chrono::duration<double> busy(0);
+    int errors = 0;
+    int n = 0;
+    for (int burst = 0; burst < options.bursts; ++burst) {
+        int pending = 0;
+        const auto burst_start = std::chrono::steady_clock::now();
+        for (int i = 0; i < options.burst_size; ++i, ++n) {
+            const auto start = std::chrono::steady_clock::now();
+            ++pending;
+            connection->call("/org/freedesktop/Notifications", "org.freedesktop.Notifications", "Notify", notify_parameters(n, images),
+                [&, start](Glib::RefPtr<Gio::AsyncResult> &result) {
+                    try {
+                        connection->call_finish(result);
+                        latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+                    } catch (const Glib::Error &error) {
+                        ++errors;
+                    }
+                    --pending;
+                }, "org.freedesktop.Notifications");
+        }
+        while (pending > 0)
+            context->iteration(true);
+        busy += std::chrono::steady_clock::now() - burst_start;
+        run_for(options.wait);
+    }
+    // Let the cache and image workers catch up
+    run_for(1000);
+    const size_t rss_end = resident_memory();
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        if (latencies.size() == 0)
+            return 0.0;
+        return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+    };
+    const double MiB = 1024.0 * 1024.0;
+    std::cout << std::format("notifications: {} in {} bursts of {}, {} different images of {}x{}\n",
+                             n, options.bursts, options.burst_size, options.images, options.image_size, options.image_size);
+    std::cout << std::format("errors: {}\n", errors);
+    std::cout << std::format("reply latency: p50 {:.3f} ms, p99 {:.3f} ms\n", percentile(0.5), percentile(0.99));
+    std::cout << std::format("throughput: {:.0f} notifications/s\n", latencies.size() / busy.count());
+    std::cout << std::format("rss: {:.1f} MiB -> {:.1f} MiB ({:+.1f} MiB)\n", rss_start / MiB, rss_end / MiB,
+                             (static_cast<double>(rss_end) - rss_start) / MiB);
+    std::cout << std::format("store: {} notifications, {:.1f} MiB\n", server.notifications.size(), server.memory_usage() / MiB);
+    std::cout << std::format("cache bytes written: {}\n", server.cache_bytes_written());
+    if (options.index_entries > 0)
+        run_index(options);
+    return errors > 0 ? 1 : 0;
+}
+
+static int run_parent(int argc, char **argv)
+{
+    char tmp_template[] = "/tmp/gtkshell-bench-XXXXXX";
+    if (mkdtemp(tmp_template) == nullptr) {
+        Utils::log(Utils::LogSeverity::ERROR, std::format("notifications_bench: cannot create a temporary directory: {}", strerror(errno)));
+        return 1;
+    }
+    const std::string tmp = tmp_template;
+
+    Glib::Pid bus_pid;
+    int bus_stdout = -1;
+    try {
+        Glib::spawn_async_with_pipes("", { "dbus-daemon", "--session", "--nofork", "--print-address" },
+                                     Glib::SpawnFlags::SEARCH_PATH | Glib::SpawnFlags::DO_NOT_REAP_CHILD, {},
+                                     &bus_pid, nullptr, &bus_stdout, nullptr);
+    } catch (const Glib::Error &error) {
+        Utils::log(Utils::LogSeverity::ERROR, std::format("notifications_bench: cannot start dbus-daemon: {}", error.what()));
+        std::filesystem::remove_all(tmp);
+        return 1;
+    }
+    std::string address;
+    char c;
+    while (read(bus_stdout, &c, 1) == 1 && c != '\n')
+        address += c;
+    close(bus_stdout);
+
+    int status = 1;
+    if (address != "") {
+        Glib::setenv("DBUS_SESSION_BUS_ADDRESS", address);
+        Glib::setenv("XDG_CACHE_HOME", tmp + "/cache");
+        std::vector<std::string> args = { "/proc/self/exe", "--child" };
+        for (int i = 1; i < argc; ++i)
+            args.push_back(argv[i]);
+        try {
+            // Inherits our stdout and stderr
+            Glib::spawn_sync("", args, Glib::SpawnFlags::DEFAULT, {}, nullptr, nullptr, &status);
+        } catch (const Glib::Error &error) {
+            Utils::log(Utils::LogSeverity::ERROR, std::format("notifications_bench: cannot run the benchmark: {}", error.what()));
+        }
+    } else {
+        Utils::log(Utils::LogSeverity::ERROR, "notifications_bench: dbus-daemon didn't print its address");
+    }
+    kill(bus_pid, SIGTERM);
+    Glib::spawn_close_pid(bus_pid);
+
+    uintmax_t cache_size = 0;
+    std::error_code error;
+    for (const auto &entry : std::filesystem::recursive_directory_iterator(tmp, error)) {
+        if (entry.is_regular_file())
+            cache_size += entry.file_size();
+    }
+    std::cout << std::format("cache size on disk: {}\n", cache_size);
+    std::filesystem::remove_all(tmp, error);
+
+    return status == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        std::cerr << "Usage: notifications_bench [-b bursts] [-n burst size] [-i images] [-p image size] [-w ms] [-x entries]" << std::endl;
+        return 1;
+    }
+    Glib::init();
+    Gio::init();
+    return options.child ? run_child(options) : run_parent(argc, argv);
+}
@@ -0,0 +1,203 @@
+#include "proctable.h"
+#include "utils.h"
+
+#include <glibmm.h>
+
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+// https://docs.kernel.org/driver-api/connector.html
+
+ProcessTable::ProcessTable(Backend backend) : backend(backend)
+{
+    if (backend == Backend::NETLINK) {
+        if (connect()) {
+            // Subscribe before seeding, so nothing that happens while we
+            // scan /proc is lost. Events are applied after the scan.
+            rescan();
+            listener = std::make_shared<std::thread>(&ProcessTable::listen, this);
+        } else {
+            this->backend = Backend::SCAN;
+        }
+    }
+}
+
+ProcessTable::~ProcessTable()
+{
+    if (listener) {
+        uint64_t one = 1;
+        if (write(wake, &one, sizeof(one)) < 0) {
+            Utils::log(Utils::LogSeverity::WARNING, std::format("ProcessTable: cannot wake listener: {}", strerror(errno)));
+        }
+        listener->join();
+    }
+    disconnect();
+}
+
+bool ProcessTable::connect()
+{
+    sock = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (sock < 0) {
+        Utils::log(Utils::LogSeverity::INFO, std::format("ProcessTable: proc connector not available ({}), scanning /proc", strerror(errno)));
+        return false;
+    }
+    struct sockaddr_nl address = {};
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = CN_IDX_PROC;
+    address.nl_pid = 0;
+    if (bind(sock, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) < 0) {
+        Utils::log(Utils::LogSeverity::INFO, std::format("ProcessTable: cannot bind to the proc connector ({}), scanning /proc", strerror(errno)));
+        disconnect();
+        return false;
+    }
+
+    // Subscription message: a netlink header followed by a connector
+    // message whose payload is the multicast operation
+    const size_t size = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op));
+    alignas(struct nlmsghdr) char request[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))] = {};
+    auto header = reinterpret_cast<struct nlmsghdr *>(request);
+    header->nlmsg_len = size;
+    header->nlmsg_pid = getpid();
+    header->nlmsg_type = NLMSG_DONE;
+    auto message = reinterpret_cast<struct cn_msg *>(NLMSG_DATA(header));
+    message->id.idx = CN_IDX_PROC;
+    message->id.val = CN_VAL_PROC;
+    message->len = sizeof(enum proc_cn_mcast_op);
+    const enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+    memcpy(message->data, &op, sizeof(op));
+    if (send(sock, request, size, 0) < 0) {
+        // Without CAP_NET_ADMIN this is where we usually fail
+        Utils::log(Utils::LogSeverity::INFO, std::format("ProcessTable: cannot subscribe to the proc connector ({}), scanning /proc", strerror(errno)));
+        disconnect();
+        return false;
+    }
+
+    wake = eventfd(0, EFD_CLOEXEC);
+    if (wake < 0) {
+        Utils::log(Utils::LogSeverity::WARNING, std::format("ProcessTable: cannot create eventfd ({}), scanning /proc", strerror(errno)));
+        disconnect();
+        return false;
+    }
+    return true;
+}
+
+void ProcessTable::disconnect()
+{
+    if (sock >= 0) {
+        close(sock);
+        sock = -1;
+    }
+    if (wake >= 0) {
+        close(wake);
+        wake = -1;
+    }
+}
+
+void ProcessTable::listen()
+{
+    alignas(struct nlmsghdr) char buffer[8192];
+    struct pollfd fds[2] = {
+        { sock, POLLIN, 0 },
+        { wake, POLLIN, 0 }
+    };
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            Utils::log(Utils::LogSeverity::ERROR, std::format("ProcessTable: poll error: {}", strerror(errno)));
+            break;
+        }
+        if (fds[1].revents & POLLIN)
+            break;
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        ssize_t len = recv(sock, buffer, sizeof(buffer), 0);
+        if (len < 0) {
+            if (errno == ENOBUFS) {
+                // The kernel dropped events, resynchronize
+                stale = true;
+            } else if (errno != EINTR) {
+                Utils::log(Utils::LogSeverity::ERROR, std::format("ProcessTable: recv error: {}", strerror(errno)));
+                break;
+            }
+            continue;
+        }
+        if (len == 0)
+            continue;
+
+        // The netlink macros work with an unsigned length
+        unsigned int remaining = static_cast<unsigned int>(len);
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto header = reinterpret_cast<struct nlmsghdr *>(buffer); NLMSG_OK(header, remaining); header = NLMSG_NEXT(header, remaining)) {
+            if (header->nlmsg_type == NLMSG_ERROR || header->nlmsg_type == NLMSG_NOOP)
+                continue;
+            auto message = reinterpret_cast<struct cn_msg *>(NLMSG_DATA(header));
+            if (message->id.idx != CN_IDX_PROC || message->id.val != CN_VAL_PROC)
+                continue;
+            auto event = reinterpret_cast<struct proc_event *>(message->data);
+            // Older kernel headers nest the event enum inside proc_event
+            using Event = decltype(event->what);
+            switch (event->what) {
+            case Event::PROC_EVENT_FORK:
+                // Only track processes, not threads
+                if (event->event_data.fork.child_pid == event->event_data.fork.child_tgid)
+                    live.insert(event->event_data.fork.child_tgid);
+                break;
+            case Event::PROC_EVENT_EXEC:
+                live.insert(event->event_data.exec.process_tgid);
+                break;
+            case Event::PROC_EVENT_EXIT:
+                if (event->event_data.exit.process_pid == event->event_data.exit.process_tgid)
+                    live.erase(event->event_data.exit.process_tgid);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    // The listener is gone, from now on scan /proc
+    backend = Backend::SCAN;
+}
+
+void ProcessTable::rescan()
+{
+    auto pids = scan();
+    std::lock_guard<std::mutex> lock(mtx);
+    live = std::set<pid_t>(pids.begin(), pids.end());
+}
+
+std::vector<pid_t> ProcessTable::pids()
+{
+    if (backend == Backend::NETLINK) {
+        if (stale.exchange(false))
+            rescan();
+        std::lock_guard<std::mutex> lock(mtx);
+        return std::vector<pid_t>(live.begin(), live.end());
+    }
+    return scan();
+}
+
+std::vector<pid_t> ProcessTable::scan()
+{
+    std::vector<pid_t> result;
+    // Every directory with a name that is a number is a process
+    try {
+        Glib::Dir proc("/proc");
+        for (auto name = proc.read_name(); name != ""; name = proc.read_name()) {
+            if (name.find_first_not_of("0123456789") == std::string::npos)
+                result.push_back(std::atoi(name.c_str()));
+        }
+    } catch (const Glib::FileError &error) {
+        Utils::log(Utils::LogSeverity::ERROR, std::format("ProcessTable: cannot read /proc: {}", error.what()));
+    }
+    return result;
+}
@@ -0,0 +1,55 @@
+#ifndef __GTKSHELL_PROCTABLE__
+#define __GTKSHELL_PROCTABLE__
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+// Set of live process ids.
+// With the NETLINK backend, the set is seeded once from /proc and then kept
+// up to date from the kernel proc connector (fork/exec/exit events), so
+// callers only need to read the processes that are alive. The proc connector
+// needs CAP_NET_ADMIN; when it is not available, the table falls back to
+// scanning /proc on every call to pids().
+class ProcessTable {
+public:
+    typedef enum {
+        SCAN = 0,
+        NETLINK
+    } Backend;
+
+    ProcessTable(Backend backend = Backend::NETLINK);
+    ~ProcessTable();
+
+    // Avoid copy creation
+    ProcessTable(const ProcessTable &) = delete;
+    void operator=(const ProcessTable &) = delete;
+
+    // Thread safe
+    std::vector<pid_t> pids();
+    Backend get_backend() const { return backend; }
+    // Reseed the table from /proc, also done after the socket overflows
+    void rescan();
+
+private:
+    bool connect();
+    void disconnect();
+    void listen();
+    static std::vector<pid_t> scan();
+
+    std::atomic<Backend> backend;
+    int sock = -1;
+    int wake = -1;
+    // Set when the socket overflowed and we lost events
+    std::atomic<bool> stale = false;
+    std::shared_ptr<std::thread> listener;
+    std::mutex mtx;
+    std::set<pid_t> live;
+};
+
+#endif // __GTKSHELL_PROCTABLE__
@@ -0,0 +1,119 @@
+// Tests for ProcessTable
+//
+// Runs the same checks against both backends: a spawned process shows up,
+// it is gone once it exits, and the snapshot after a rescan matches /proc.
+// The NETLINK backend needs CAP_NET_ADMIN, without it that part is skipped.
+//
+// proctable_test [scan|netlink] (default = both)
+
+#include "proctable.h"
+#include "utils.h"
+
+#include <glibmm.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Same as automake, ctest reports it as skipped
+static const int EXIT_SKIP = 77;
+// Netlink events arrive asynchronously
+static const auto EVENT_TIMEOUT = std::chrono::seconds(2);
+
+static bool contains(const std::vector<pid_t> &pids, pid_t pid)
+{
+    return std::find(pids.begin(), pids.end(), pid) != pids.end();
+}
+
+static bool wait_for(ProcessTable &table, const std::function<bool(const std::vector<pid_t> &)> &condition)
+{
+    const auto deadline = std::chrono::steady_clock::now() + EVENT_TIMEOUT;
+    while (std::chrono::steady_clock::now() < deadline) {
+        if (condition(table.pids()))
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+static bool check(bool condition, const std::string &backend, const std::string &what)
+{
+    std::cout << std::format("{}: {}: {}\n", backend, what, condition ? "ok" : "FAILED");
+    return condition;
+}
+
+static int run(ProcessTable::Backend backend)
+{
+    const std::string name = backend == ProcessTable::Backend::NETLINK ? "netlink" : "scan";
+    ProcessTable table(backend);
+    if (table.get_backend() != backend) {
+        std::cout << std::format("{}: backend not available, skipped\n", name);
+        return EXIT_SKIP;
+    }
+
+    bool ok = true;
+    ok &= check(contains(table.pids(), getpid()), name, "own process listed");
+
+    pid_t child = fork();
+    if (child < 0) {
+        Utils::log(Utils::LogSeverity::ERROR, std::format("proctable_test: fork failed: {}", strerror(errno)));
+        return 1;
+    }
+    if (child == 0) {
+        pause();
+        _exit(0);
+    }
+    ok &= check(wait_for(table, [child](const std::vector<pid_t> &pids) { return contains(pids, child); }), name, "spawned process listed");
+
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+    ok &= check(wait_for(table, [child](const std::vector<pid_t> &pids) { return !contains(pids, child); }), name, "exited process removed");
+
+    // After a rescan the table has everything /proc had before, except for
+    // processes that exited in between
+    std::vector<pid_t> proc;
+    for (const auto &entry : std::filesystem::directory_iterator("/proc")) {
+        auto file = entry.path().filename().string();
+        if (file.find_first_not_of("0123456789") == std::string::npos)
+            proc.push_back(std::atoi(file.c_str()));
+    }
+    table.rescan();
+    auto pids = table.pids();
+    auto alive = [](pid_t pid) { return kill(pid, 0) == 0 || errno == EPERM; };
+    size_t missing = std::count_if(proc.begin(), proc.end(), [&pids, &alive](pid_t pid) { return alive(pid) && !contains(pids, pid); });
+    ok &= check(contains(pids, getpid()) && !contains(pids, child), name, "snapshot after rescan");
+    ok &= check(missing == 0, name, std::format("snapshot matches /proc ({} missing)", missing));
+
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<ProcessTable::Backend> backends;
+    if (argc < 2 || strcmp(argv[1], "scan") == 0)
+        backends.push_back(ProcessTable::Backend::SCAN);
+    if (argc < 2 || strcmp(argv[1], "netlink") == 0)
+        backends.push_back(ProcessTable::Backend::NETLINK);
+    if (backends.size() == 0) {
+        std::cerr << "Usage: proctable_test [scan|netlink]" << std::endl;
+        return 1;
+    }
+
+    int status = 0;
+    for (auto backend : backends) {
+        int result = run(backend);
+        // Only skip when nothing ran
+        if (result == 1 || (result == EXIT_SKIP && backends.size() == 1))
+            status = result;
+    }
+    return status;
+}
@@ -63,3 +63,7 @@ void GtkShellWindow::add_to_layer(const char *name, GtkShellAnchor anchor, const
     }
 }
 
+void GtkShellWindow::set_keyboard_on_demand(bool on_demand)
+{
+    gtk_layer_set_keyboard_mode(this->gobj(), on_demand ? GTK_LAYER_SHELL_KEYBOARD_MODE_ON_DEMAND : GTK_LAYER_SHELL_KEYBOARD_MODE_NONE);
+}
@@ -33,6 +33,10 @@ public:
     }
     virtual ~GtkShellWindow() {}
 
+    // Layer surfaces don't get keyboard focus by default. With on demand,
+    // they get it when the user clicks on them.
+    void set_keyboard_on_demand(bool on_demand);
+
 private:
     void add_to_layer(const char *name, GtkShellAnchor anchor, const char *monitor_conn, bool exclusive_zone, GtkShellStretch stretch);
 };
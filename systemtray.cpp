@@ -6,12 +6,54 @@
 #include <gdkmm.h>
 #include <gtkmm/menubutton.h>
 
+#include <bit>
+#include <cstring>
+#include <set>
+#include <string_view>
+
 template<typename T>
-T get_proxy_property(Glib::RefPtr<Gio::DBus::Proxy> &proxy, const Glib::ustring &name)
+T get_property(const std::map<Glib::ustring, Glib::VariantBase> &properties, const Glib::ustring &name)
+{
+    auto prop = properties.find(name);
+    if (prop == properties.end())
+        return T();
+    try {
+        return prop->second.get_dynamic<T>();
+    } catch (const std::bad_cast &) {
+        // Some clients send the wrong type
+        return T();
+    }
+}
+
+// Textures of the tray pixmaps, shared by all the items
+TextureCache SystemTrayItem::texture_cache;
+
+Glib::RefPtr<Gdk::Texture> TextureCache::get(size_t hash, int32_t width, int32_t height, const uint8_t *data, size_t len)
+{
+    auto entry = entries.find(hash);
+    if (entry == entries.end())
+        return nullptr;
+    auto &e = entry->second;
+    if (e.width != width || e.height != height || e.data.size() != len || memcmp(e.data.data(), data, len) != 0)
+        return nullptr;
+    lru.splice(lru.begin(), lru, e.lru);
+    return e.texture;
+}
+
+void TextureCache::put(size_t hash, int32_t width, int32_t height, const uint8_t *data, size_t len, const Glib::RefPtr<Gdk::Texture> &texture)
 {
-    Glib::Variant<T> prop;
-    proxy->get_cached_property(prop, name);
-    return prop.gobj() ? prop.get() : T();
+    // A colliding pixmap takes the place of the old one
+    auto entry = entries.find(hash);
+    if (entry != entries.end()) {
+        lru.erase(entry->second.lru);
+        entries.erase(entry);
+    }
+    lru.push_front(hash);
+    entries[hash] = { width, height, std::vector<uint8_t>(data, data + len), texture, lru.begin() };
+    if (entries.size() > MAX_ENTRIES) {
+        entries.erase(lru.back());
+        lru.pop_back();
+    }
 }
 
 // file:///usr/share/gtk-doc/html/libdbusmenu-glib/index.html
@@ -76,38 +118,203 @@ private:
 
 class DBusMenu : public Gtk::PopoverMenu {
 public:
-    DBusMenu(const Glib::ustring &bus_name, const Glib::ustring &path) {
+    // Nothing is requested until the menu is shown for the first time
+    DBusMenu(const Glib::ustring &bus_name, const Glib::ustring &path) : bus_name(bus_name) {
         add_css_class("systray-item");
         set_flags(Gtk::PopoverMenu::Flags::NESTED);
         set_expand(true);
-        Glib::RefPtr<Gio::DBus::InterfaceInfo> interface_info = Gio::DBus::NodeInfo::create_for_xml(DBUS_CANONICAL_DBUSMENU)->lookup_interface("com.canonical.dbusmenu");
         if (path == "/StatusNotifierItem")
-            proxy = Gio::DBus::Proxy::create_for_bus_sync(Gio::DBus::BusType::SESSION, bus_name, "/MenuBar", "com.canonical.dbusmenu", interface_info);
+            menu_path = "/MenuBar";
         else
-            proxy = Gio::DBus::Proxy::create_for_bus_sync(Gio::DBus::BusType::SESSION, bus_name, path + "/Menu", "com.canonical.dbusmenu", interface_info);
-        proxy->connect_property_changed("LayoutUpdated", [this] () { update_menu(); });
-        proxy->connect_property_changed("ItemsPropertiesUpdated", [this] () { update_menu(); });
-
-        update_menu();
+            menu_path = path + "/Menu";
+        alive = Gio::Cancellable::create();
+        menu = Gio::Menu::create();
+        submenus[0] = menu;
+        action_group = Gio::SimpleActionGroup::create();
+        set_menu_model(menu);
+        insert_action_group("actions", action_group);
+        signal_show().connect([this]() { about_to_show(); });
+    }
+    ~DBusMenu() {
+        // Pending replies must not reach a deleted menu
+        alive->cancel();
     }
 
 private:
-    void update_menu() {
-        auto params = Glib::Variant<std::tuple<int32_t, int32_t, std::vector<Glib::ustring>>>::create({ 0, -1, { "type", "children-display", "label", "enabled", "visible", "toggle-type", "toggle-state" } });
-        try {
-            auto response = proxy->call_sync("GetLayout", params);
-            auto rev = response.get_child(0).get_dynamic<uint32_t>();
-            if (rev > 0 && rev == revision)
+    void about_to_show() {
+        auto alive = this->alive;
+        if (proxy == nullptr) {
+            if (connecting)
                 return;
-            revision = rev;
-            menu = Gio::Menu::create();
+            connecting = true;
+            Glib::RefPtr<Gio::DBus::InterfaceInfo> interface_info = Gio::DBus::NodeInfo::create_for_xml(DBUS_CANONICAL_DBUSMENU)->lookup_interface("com.canonical.dbusmenu");
+            Gio::DBus::Proxy::create_for_bus(Gio::DBus::BusType::SESSION, bus_name, menu_path, "com.canonical.dbusmenu",
+                [this, alive](Glib::RefPtr<Gio::AsyncResult> &result) {
+                    if (alive->is_cancelled())
+                        return;
+                    connecting = false;
+                    try {
+                        proxy = Gio::DBus::Proxy::create_for_bus_finish(result);
+                    } catch (const Glib::Error &error) {
+                        Utils::log(Utils::LogSeverity::INFO, std::format("Error! {}", error.what()));
+                        return;
+                    }
+                    proxy->signal_signal().connect(sigc::mem_fun(*this, &DBusMenu::on_signal));
+                    about_to_show();
+                }, alive, interface_info, Gio::DBus::ProxyFlags::DO_NOT_LOAD_PROPERTIES);
+            return;
+        }
+        // Give the application a chance to update the menu, and fetch it
+        // only if it changed
+        auto params = Glib::Variant<std::tuple<int32_t>>::create({ 0 });
+        proxy->call("AboutToShow",
+            [this, alive](Glib::RefPtr<Gio::AsyncResult> &result) {
+                if (alive->is_cancelled())
+                    return;
+                bool update = !loaded;
+                try {
+                    auto response = proxy->call_finish(result);
+                    update = update || response.get_child(0).get_dynamic<bool>();
+                } catch (const Glib::Error &error) {
+                    // AboutToShow is optional, many applications don't implement it
+                }
+                if (update)
+                    fetch_layout(0);
+            }, alive, params);
+    }
+
+    // Fetches the subtree of parent and replaces it in the menu
+    void fetch_layout(int32_t parent) {
+        auto alive = this->alive;
+        auto params = Glib::Variant<std::tuple<int32_t, int32_t, std::vector<Glib::ustring>>>::create({ parent, -1, { "type", "children-display", "label", "enabled", "visible", "toggle-type", "toggle-state" } });
+        proxy->call("GetLayout",
+            [this, alive, parent](Glib::RefPtr<Gio::AsyncResult> &result) {
+                if (alive->is_cancelled())
+                    return;
+                try {
+                    auto response = proxy->call_finish(result);
+                    auto rev = response.get_child(0).get_dynamic<uint32_t>();
+                    if (parent == 0 && loaded && rev > 0 && rev == revision)
+                        return;
+                    revision = rev;
+                    update_submenu(parent, response.get_child(1));
+                    if (parent == 0)
+                        loaded = true;
+                } catch (const Glib::Error &error) {
+                    Utils::log(Utils::LogSeverity::INFO, std::format("Error! {}", error.what()));
+                }
+            }, alive, params);
+    }
+
+    void on_signal(const Glib::ustring &, const Glib::ustring &signal_name, const Glib::VariantContainerBase &parameters) {
+        // Until the menu is shown, there is nothing to update
+        if (!loaded)
+            return;
+        if (signal_name == "LayoutUpdated") {
+            auto parent = parameters.get_child(1).get_dynamic<int32_t>();
+            schedule_update(parent);
+        } else if (signal_name == "ItemsPropertiesUpdated") {
+            auto updated = parameters.get_child(0).get_dynamic<std::vector<std::tuple<int32_t, std::map<Glib::ustring, Glib::VariantBase>>>>();
+            for (const auto &item : updated)
+                update_item(std::get<0>(item), std::get<1>(item));
+            // Removed properties go back to their defaults
+            auto removed = parameters.get_child(1).get_dynamic<std::vector<std::tuple<int32_t, std::vector<Glib::ustring>>>>();
+            for (const auto &item : removed)
+                schedule_update(get_parent(std::get<0>(item)));
+        }
+    }
+
+    // Enabled and toggle state only change the action. Anything else
+    // requires rebuilding the submenu containing the item.
+    void update_item(int32_t id, const std::map<Glib::ustring, Glib::VariantBase> &properties) {
+        auto action = std::dynamic_pointer_cast<Gio::SimpleAction>(action_group->lookup_action(std::format("{}", id)));
+        if (action == nullptr) {
+            schedule_update(get_parent(id));
+            return;
+        }
+        for (const auto &property : properties) {
+            if (property.first == "enabled") {
+                action->set_enabled(property.second.get_dynamic<bool>());
+            } else if (property.first == "toggle-state") {
+                auto state = action->get_state_variant();
+                if (state.gobj() == nullptr) {
+                    schedule_update(get_parent(id));
+                } else if (state.get_type_string() == "b") {
+                    action->set_state(Glib::Variant<bool>::create(property.second.get_dynamic<int32_t>() != 0));
+                } else {
+                    action->set_state(Glib::Variant<int32_t>::create(property.second.get_dynamic<int32_t>()));
+                }
+            } else {
+                schedule_update(get_parent(id));
+            }
+        }
+    }
+
+    int32_t get_parent(int32_t id) {
+        auto parent = parents.find(id);
+        return parent != parents.end() ? parent->second : 0;
+    }
+
+    // Applications often send many updates in a row, fetch once per idle
+    void schedule_update(int32_t parent) {
+        dirty.insert(parent);
+        if (update_pending)
+            return;
+        update_pending = true;
+        auto alive = this->alive;
+        Glib::signal_idle().connect_once([this, alive]() {
+            if (alive->is_cancelled())
+                return;
+            update_pending = false;
+            if (dirty.contains(0)) {
+                fetch_layout(0);
+            } else {
+                for (auto parent : dirty)
+                    fetch_layout(parent);
+            }
+            dirty.clear();
+        });
+    }
+
+    void update_submenu(int32_t id, const Glib::VariantBase &container) {
+        auto submenu = submenus.find(id);
+        if (submenu == submenus.end()) {
+            // We don't know this submenu (it may be hidden), rebuild everything
+            if (id != 0)
+                schedule_update(0);
+            return;
+        }
+        auto data = container.get_dynamic<std::tuple<int32_t, std::map<Glib::ustring, Glib::VariantBase>, std::vector<Glib::VariantBase>>>();
+        // The Gio::Menu is kept, so the popover and the parent item don't change
+        submenu->second->remove_all();
+        forget_children(id);
+        fill_menu(submenu->second, id, std::get<2>(data));
+    }
+
+    // Drops the actions, submenus and parents of everything below id, so
+    // items that don't exist anymore can't send events
+    void forget_children(int32_t id) {
+        if (id == 0) {
             action_group = Gio::SimpleActionGroup::create();
-            recurse_menu_update(menu, response.get_child(1));
-        } catch (Glib::Error &error) {
-            Utils::log(Utils::LogSeverity::INFO, std::format("Error! {}", error.what()));
+            insert_action_group("actions", action_group);
+            submenus.clear();
+            submenus[0] = menu;
+            parents.clear();
+            return;
+        }
+        std::vector<int32_t> pending = { id };
+        while (!pending.empty()) {
+            auto parent = pending.back();
+            pending.pop_back();
+            std::erase_if(parents, [&](const auto &item) {
+                if (item.second != parent)
+                    return false;
+                action_group->remove_action(std::format("{}", item.first));
+                submenus.erase(item.first);
+                pending.push_back(item.first);
+                return true;
+            });
         }
-        set_menu_model(menu);
-        insert_action_group("actions", action_group);
     }
 
     Glib::ustring get_item_type(const Glib::VariantBase &container) {
@@ -121,18 +328,45 @@ private:
     }
 
     void send_click_event(int id) {
+        auto alive = this->alive;
         auto params = Glib::Variant<std::tuple<int32_t, Glib::ustring, Glib::VariantBase, uint32_t>>::create({id, "clicked", Glib::Variant<uint8_t>::create(0), 0});
-        try {
-            proxy->call_sync("Event", params);
-        } catch (Glib::Error &error) {
-            Utils::log(Utils::LogSeverity::INFO, std::format("Error! {}", error.what()));
+        proxy->call("Event",
+            [this, alive](Glib::RefPtr<Gio::AsyncResult> &result) {
+                if (alive->is_cancelled())
+                    return;
+                try {
+                    proxy->call_finish(result);
+                } catch (const Glib::Error &error) {
+                    Utils::log(Utils::LogSeverity::INFO, std::format("Error! {}", error.what()));
+                }
+            }, alive, params);
+    }
+
+    void fill_menu(const Glib::RefPtr<Gio::Menu> &menu, int32_t parent, const std::vector<Glib::VariantBase> &children) {
+        Glib::RefPtr<Gio::Menu> cursection;
+        for (auto child : children) {
+            if (get_item_type(child) == "separator") {
+                // We don't add separators as menu items, just create a new section
+                if (cursection != nullptr) {
+                    menu->append_section(cursection);
+                }
+                cursection = Gio::Menu::create();
+            } else {
+                if (cursection != nullptr)
+                    recurse_menu_update(cursection, parent, child);
+                else
+                    recurse_menu_update(menu, parent, child);
+            }
         }
+        if (cursection != nullptr)
+            menu->append_section(cursection);
     }
 
-    void recurse_menu_update(Glib::RefPtr<Gio::Menu> &menu, const Glib::VariantBase &container) {
+    void recurse_menu_update(const Glib::RefPtr<Gio::Menu> &menu, int32_t parent, const Glib::VariantBase &container) {
         auto data = container.get_dynamic<std::tuple<int32_t, std::map<Glib::ustring, Glib::VariantBase>, std::vector<Glib::VariantBase>>>();
         auto id = std::get<0>(data);
         auto properties = std::get<1>(data);
+        parents[id] = parent;
 
         // First, create a menu_item so we parse all the parameters in properties.
         // We may later discard it if it is a separator etc.
@@ -141,30 +375,10 @@ private:
 
         if (menu_item->get_parameter_children_display() == "submenu") {
             // This id contains a submenu
-            bool in_section = false;
             auto submenu = Gio::Menu::create();
-            auto children = std::get<2>(data);
-            Glib::RefPtr<Gio::Menu> cursection;
-            for (auto child : children) {
-                if (get_item_type(child) == "separator") {
-                    // We don't add separators as menu items, just create a new section
-                    if (cursection != nullptr) {
-                        submenu->append_section(cursection);
-                    }
-                    cursection = Gio::Menu::create();
-                } else {
-                    if (cursection != nullptr)
-                        recurse_menu_update(cursection, child);
-                    else
-                        recurse_menu_update(submenu, child);
-                }
-            }
-            if (cursection != nullptr)
-                submenu->append_section(cursection);
-            if (id == 0)
-                menu = submenu;
-            else
-                menu->append_submenu(menu_item->get_parameter_label(), submenu);
+            submenus[id] = submenu;
+            fill_menu(submenu, id, std::get<2>(data));
+            menu->append_submenu(menu_item->get_parameter_label(), submenu);
             return;
         }
         Glib::ustring action_name = std::format("{}", id);
@@ -199,10 +413,22 @@ private:
         }
     }
 
+    Glib::ustring bus_name;
+    Glib::ustring menu_path;
+    bool connecting = false;
+    // The full layout has been fetched at least once
+    bool loaded = false;
     uint32_t revision = 0;
     Glib::RefPtr<Gio::Menu> menu;
+    // Menus by item id, 0 is the root
+    std::map<int32_t, Glib::RefPtr<Gio::Menu>> submenus;
+    // Parent item of each item
+    std::map<int32_t, int32_t> parents;
+    std::set<int32_t> dirty;
+    bool update_pending = false;
     Glib::RefPtr<Gio::DBus::Proxy> proxy;
     Glib::RefPtr<Gio::SimpleActionGroup> action_group;
+    Glib::RefPtr<Gio::Cancellable> alive;
 };
 
 
@@ -211,86 +437,181 @@ SystemTrayItem::SystemTrayItem(const Glib::ustring &bus_name, const Glib::ustrin
 {
     add_css_class("systray-item");
     Glib::RefPtr<Gio::DBus::InterfaceInfo> item_interface_info = Gio::DBus::NodeInfo::create_for_xml(DBUS_KDE_STATUSNOTIFIERITEM)->lookup_interface("org.kde.StatusNotifierItem");
+    // Properties are fetched with GetAll, so the proxy doesn't need to load them
     Gio::DBus::Proxy::create_for_bus(Gio::DBus::BusType::SESSION, bus_name, path, "org.kde.StatusNotifierItem",
                                      [this, bus_name, path](Glib::RefPtr<Gio::AsyncResult> &result) {
+                                         try {
+                                             proxy = Gio::DBus::Proxy::create_for_bus_finish(result);
+                                         } catch (const Glib::Error &error) {
+                                             Utils::log(Utils::LogSeverity::ERROR, std::format("system tray: DBus: cannot create proxy for {}{}: {}", bus_name.c_str(), path.c_str(), error.what()));
+                                             return;
+                                         }
                                          menu = Glib::RefPtr<DBusMenu>(new DBusMenu(bus_name, path));
                                          set_popover(*menu);
-                                         proxy = Gio::DBus::Proxy::create_for_bus_finish(result);
                                          refresh_properties();
                                          proxy->connect_property_changed("g-name-owner",
                                                                          [this]() {
                                                                              signal_removed(this->bus_name + this->path);
                                                                          });
-                                         proxy->connect_property_changed("g-signal",
-                                                                         [this]() {
-                                                                             refresh_properties();
-                                                                         });
-                                         proxy->connect_property_changed("g-properties-changed",
-                                                                         [this]() {
-                                                                             signal_changed();
-                                                                         });
-                                         proxy->connect_property_changed("NewIcon", [this] () { sync_icons(); });
-                                         proxy->connect_property_changed("NewAttentionIcon", [this] () { sync_icons(); });
-                                         proxy->connect_property_changed("NewOverlayIcon", [this] () { sync_icons(); });
+                                         proxy->signal_signal().connect(
+                                             [this](const Glib::ustring &, const Glib::ustring &signal_name, const Glib::VariantContainerBase &) {
+                                                 if (signal_name == "NewIcon" || signal_name == "NewAttentionIcon" || signal_name == "NewOverlayIcon" ||
+                                                     signal_name == "NewTitle" || signal_name == "NewToolTip" || signal_name == "NewStatus")
+                                                     refresh_properties();
+                                             });
+                                         auto sender = proxy->get_name_owner();
+                                         properties_subscription = proxy->get_connection()->signal_subscribe(
+                                             [this](const Glib::RefPtr<Gio::DBus::Connection> &, const Glib::ustring &, const Glib::ustring &,
+                                                    const Glib::ustring &, const Glib::ustring &, const Glib::VariantContainerBase &) {
+                                                 refresh_properties();
+                                             },
+                                             sender != "" ? sender : bus_name, "org.freedesktop.DBus.Properties", "PropertiesChanged", path,
+                                             "org.kde.StatusNotifierItem");
                                          signal_ready(); },
-                                     item_interface_info);
+                                     item_interface_info, Gio::DBus::ProxyFlags::DO_NOT_LOAD_PROPERTIES);
 }
 
 void SystemTrayItem::refresh_properties()
 {
-    sync_icons();
+    // Only the latest request matters. Clients often send several signals
+    // in a row, cancel the request in flight so we only apply the last one.
+    if (cancellable)
+        cancellable->cancel();
+    auto current = Gio::Cancellable::create();
+    cancellable = current;
+    auto params = Glib::VariantContainerBase::create_tuple({ Glib::Variant<Glib::ustring>::create("org.kde.StatusNotifierItem") });
+    proxy->get_connection()->call(path, "org.freedesktop.DBus.Properties", "GetAll", params,
+        [this, current](Glib::RefPtr<Gio::AsyncResult> &result) {
+            // Cancelled requests may belong to an item that doesn't exist anymore
+            if (current->is_cancelled())
+                return;
+            try {
+                auto response = proxy->get_connection()->call_finish(result);
+                auto properties = response.get_child(0).get_dynamic<std::map<Glib::ustring, Glib::VariantBase>>();
+                apply_properties(properties);
+            } catch (const Glib::Error &error) {
+                Utils::log(Utils::LogSeverity::WARNING, std::format("system tray: DBus: cannot get properties of {}{}: {}", bus_name.c_str(), path.c_str(), error.what()));
+            } catch (const std::bad_cast &) {
+                Utils::log(Utils::LogSeverity::WARNING, std::format("system tray: DBus: invalid properties from {}{}", bus_name.c_str(), path.c_str()));
+            }
+        }, current, bus_name);
 }
 
-SystemTrayItem::~SystemTrayItem()
+void SystemTrayItem::apply_properties(const std::map<Glib::ustring, Glib::VariantBase> &properties)
 {
-
+    typedef std::vector<std::tuple<int32_t, int32_t, std::vector<uint8_t>>> Pixmap;
+    title = get_property<Glib::ustring>(properties, "Title");
+    status = get_property<Glib::ustring>(properties, "Status");
+    auto tool_tip = get_property<std::tuple<Glib::ustring, Pixmap, Glib::ustring, Glib::ustring>>(properties, "ToolTip");
+    tooltip = std::get<2>(tool_tip) != "" ? std::get<2>(tool_tip) : title;
+
+    icon_name = get_property<Glib::ustring>(properties, "IconName");
+    icon_texture = nullptr;
+    if (icon_name == "") {
+        auto icon_pixmap = get_property<Pixmap>(properties, "IconPixmap");
+        if (icon_pixmap.size() > 0)
+            icon_texture = parse_icon(icon_pixmap);
+    }
+    overlay_icon_name = get_property<Glib::ustring>(properties, "OverlayIconName");
+    overlay_texture = nullptr;
+    if (overlay_icon_name == "") {
+        auto overlay_icon_pixmap = get_property<Pixmap>(properties, "OverlayIconPixmap");
+        if (overlay_icon_pixmap.size() > 0)
+            overlay_texture = parse_icon(overlay_icon_pixmap);
+    }
+    attention_icon_name = get_property<Glib::ustring>(properties, "AttentionIconName");
+    attention_texture = nullptr;
+    if (attention_icon_name == "") {
+        auto attention_icon_pixmap = get_property<Pixmap>(properties, "AttentionIconPixmap");
+        if (attention_icon_pixmap.size() > 0)
+            attention_texture = parse_icon(attention_icon_pixmap);
+    }
+    set_tooltip_text(tooltip);
+    sync_icons();
 }
 
-Glib::RefPtr<const Gdk::Pixbuf> SystemTrayItem::parse_icon(const std::vector<std::tuple<int32_t, int32_t, std::vector<uint8_t>>> &icon_data)
+SystemTrayItem::~SystemTrayItem()
 {
-    // Get first icon
-    auto width = std::get<0>(icon_data[0]);
-    auto height = std::get<1>(icon_data[0]);
-    auto pixbuf = Gdk::Pixbuf::create_from_data(std::get<2>(icon_data[0]).data(), Gdk::Colorspace::RGB, true, 8, width, height, 4 * width);
-    return pixbuf;
+    if (cancellable)
+        cancellable->cancel();
+    if (properties_subscription != 0)
+        proxy->get_connection()->signal_unsubscribe(properties_subscription);
 }
 
-void SystemTrayItem::sync_icons()
+Glib::RefPtr<Gdk::Texture> SystemTrayItem::parse_icon(const std::vector<std::tuple<int32_t, int32_t, std::vector<uint8_t>>> &icon_data)
 {
-    icon_name = get_proxy_property<Glib::ustring>(proxy, "IconName");
-    if (icon_name == "") {
-        std::vector<std::tuple<int32_t, int32_t, std::vector<uint8_t>>> icon_pixmap = get_proxy_property<std::vector<std::tuple<int32_t, int32_t, std::vector<uint8_t>>>>(proxy, "IconPixmap");
-        if (icon_pixmap.size() > 0) {
-            icon_pixbuf = parse_icon(icon_pixmap);
+    // Pick the smallest icon that is at least as big as what we show,
+    // otherwise the biggest one
+    const int pixel_size = image && image->get_pixel_size() > 0 ? image->get_pixel_size() : DEFAULT_ICON_SIZE;
+    const int size = pixel_size * get_scale_factor();
+    const std::tuple<int32_t, int32_t, std::vector<uint8_t>> *best = nullptr;
+    for (const auto &icon : icon_data) {
+        auto width = std::get<0>(icon);
+        auto height = std::get<1>(icon);
+        if (width <= 0 || height <= 0 || std::get<2>(icon).size() < static_cast<size_t>(width) * height * 4)
+            continue;
+        if (best == nullptr) {
+            best = &icon;
+            continue;
         }
+        auto best_width = std::get<0>(*best);
+        if ((best_width < size && width > best_width) || (width >= size && width < best_width))
+            best = &icon;
     }
-    overlay_icon_name = get_proxy_property<Glib::ustring>(proxy, "OverlayIconName");
-    if (overlay_icon_name == "") {
-        std::vector<std::tuple<int32_t, int32_t, std::vector<uint8_t>>> overlay_icon_pixmap = get_proxy_property<std::vector<std::tuple<int32_t, int32_t, std::vector<uint8_t>>>>(proxy, "OverlayIconPixmap");
-        if (overlay_icon_pixmap.size() > 0) {
-            overlay_pixbuf = parse_icon(overlay_icon_pixmap);
+    if (best == nullptr)
+        return nullptr;
+
+    auto width = std::get<0>(*best);
+    auto height = std::get<1>(*best);
+    const auto &data = std::get<2>(*best);
+    const size_t len = static_cast<size_t>(width) * height * 4;
+    // Apps like to resend the same pixmaps, hashing is much cheaper than
+    // converting and uploading them again
+    auto hash = std::hash<std::string_view>()(std::string_view(reinterpret_cast<const char *>(data.data()), len)) ^ (static_cast<size_t>(width) << 32 | height);
+    auto texture = texture_cache.get(hash, width, height, data.data(), len);
+    if (texture)
+        return texture;
+
+    // ARGB32 in network byte order to RGBA, straight into the pixbuf. The
+    // pixbuf owns its pixels, unlike create_from_data(). Rows are word
+    // aligned, written as a plain loop over words so the compiler
+    // vectorizes it.
+    auto pixbuf = Gdk::Pixbuf::create(Gdk::Colorspace::RGB, true, 8, width, height);
+    for (int row = 0; row < height; ++row) {
+        auto dst = reinterpret_cast<uint32_t *>(pixbuf->get_pixels() + row * pixbuf->get_rowstride());
+        const uint8_t *src = data.data() + static_cast<size_t>(row) * width * 4;
+        for (int x = 0; x < width; ++x) {
+            uint32_t pixel;
+            memcpy(&pixel, src + x * 4, sizeof(pixel));
+            if constexpr (std::endian::native == std::endian::little)
+                dst[x] = std::rotr(pixel, 8);
+            else
+                dst[x] = std::rotl(pixel, 8);
         }
     }
-    attention_icon_name = get_proxy_property<Glib::ustring>(proxy, "AttentionIconName");
-    if (attention_icon_name == "") {
-        std::vector<std::tuple<int32_t, int32_t, std::vector<uint8_t>>> attention_icon_pixmap = get_proxy_property<std::vector<std::tuple<int32_t, int32_t, std::vector<uint8_t>>>>(proxy, "AttentionIconPixmap");
-        if (attention_icon_pixmap.size() > 0) {
-            attention_pixbuf = parse_icon(attention_icon_pixmap);
-        }
+    texture = Gdk::Texture::create_for_pixbuf(pixbuf);
+    texture_cache.put(hash, width, height, data.data(), len, texture);
+    return texture;
+}
+
+void SystemTrayItem::sync_icons()
+{
+    // Only this item is redrawn, the tray layout doesn't change
+    if (image == nullptr) {
+        image = Glib::RefPtr<Gtk::Image>(new Gtk::Image());
+        set_child(*image);
     }
-    image = Glib::RefPtr<Gtk::Image>(new Gtk::Image());
     if (icon_name != "") {
         if (Glib::file_test(icon_name.c_str(), Glib::FileTest::EXISTS)) {
             image->set(icon_name);
         } else {
             image->set_from_icon_name(icon_name);
         }
-    } else if (icon_pixbuf != nullptr) {
-        image->set(icon_pixbuf);
+    } else if (icon_texture != nullptr) {
+        image->set(std::static_pointer_cast<Gdk::Paintable>(icon_texture));
     } else {
         image->set_from_icon_name("image-missing");
     }
-    set_child(*image);
 }
 
 
@@ -332,7 +653,6 @@ void SystemTray::on_server_method_call(const Glib::RefPtr<Gio::DBus::Connection>
             [this, item, item_name, bus_name]() {
                 registered_items[item_name] = item;
                 signal_added(item_name);
-                signal_changed();
                 auto response = Glib::VariantContainerBase::create_tuple({Glib::Variant<std::string>::create(item_name)});
                 auto connection = Gio::DBus::Connection::get_sync(Gio::DBus::BusType::SESSION);
                 connection->emit_signal("/StatusNotifierWatcher", "org.kde.StatusNotifierWatcher", "StatusNotifierItemRegistered", bus_name, response);
@@ -341,15 +661,15 @@ void SystemTray::on_server_method_call(const Glib::RefPtr<Gio::DBus::Connection>
         item->signal_removed.connect(
             [this, bus_name](const Glib::ustring &item_name) {
                 auto iter = registered_items.find(item_name);
-                if (iter != registered_items.end()) {
-                    delete iter->second;
-                    registered_items.erase(iter);
-                }
+                if (iter == registered_items.end())
+                    return;
+                // Listeners still need the item to unparent it
                 signal_removed(item_name);
-                signal_changed();
+                delete iter->second;
+                registered_items.erase(iter);
                 auto response = Glib::VariantContainerBase::create_tuple({Glib::Variant<std::string>::create(item_name)});
                 auto connection = Gio::DBus::Connection::get_sync(Gio::DBus::BusType::SESSION);
-                connection->emit_signal("/StatusNotifierWatcher", "org.kde.StatusNotifierWatcher", "StatusNotifierItemRegistered", bus_name, response);
+                connection->emit_signal("/StatusNotifierWatcher", "org.kde.StatusNotifierWatcher", "StatusNotifierItemUnregistered", bus_name, response);
             });
 
     } else if (method_name == "RegisterStatusNotifierHost") {
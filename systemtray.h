@@ -8,21 +8,48 @@
 #include <gtkmm/gestureclick.h>
 #include <gtkmm/menubutton.h>
 
+#include <list>
+#include <unordered_map>
+#include <vector>
+
 class DBusMenu;
 
+// Small LRU of textures by pixmap content. Entries are found by hash, but
+// the pixmap is compared too, so a collision is only a miss.
+class TextureCache {
+public:
+    Glib::RefPtr<Gdk::Texture> get(size_t hash, int32_t width, int32_t height, const uint8_t *data, size_t len);
+    void put(size_t hash, int32_t width, int32_t height, const uint8_t *data, size_t len, const Glib::RefPtr<Gdk::Texture> &texture);
+
+private:
+    static constexpr size_t MAX_ENTRIES = 64;
+
+    typedef struct {
+        int32_t width;
+        int32_t height;
+        std::vector<uint8_t> data;
+        Glib::RefPtr<Gdk::Texture> texture;
+        std::list<size_t>::iterator lru;
+    } Entry;
+
+    std::list<size_t> lru;
+    std::unordered_map<size_t, Entry> entries;
+};
+
 class SystemTrayItem : public Gtk::MenuButton {
 public:
     SystemTrayItem(const Glib::ustring &bus_name, const Glib::ustring &path);
     ~SystemTrayItem();
 
     sigc::signal<void(Glib::ustring)> signal_removed;
-    sigc::signal<void()> signal_changed;
     sigc::signal<void()> signal_ready;
 
 private:
+    // Fetches all the properties asynchronously
     void refresh_properties();
+    void apply_properties(const std::map<Glib::ustring, Glib::VariantBase> &properties);
     void sync_icons();
-    Glib::RefPtr<const Gdk::Pixbuf> parse_icon(const std::vector<std::tuple<int32_t, int32_t, std::vector<uint8_t>>> &icon_data);
+    Glib::RefPtr<Gdk::Texture> parse_icon(const std::vector<std::tuple<int32_t, int32_t, std::vector<uint8_t>>> &icon_data);
 
     Glib::ustring bus_name;
     Glib::ustring path;
@@ -32,11 +59,20 @@ private:
     Glib::ustring status;
 
     Glib::ustring icon_name, overlay_icon_name, attention_icon_name;
-    Glib::RefPtr<const Gdk::Pixbuf> icon_pixbuf, overlay_pixbuf, attention_pixbuf;
+    Glib::RefPtr<Gdk::Texture> icon_texture, overlay_texture, attention_texture;
     Glib::RefPtr<DBusMenu> menu;
     Glib::RefPtr<Gtk::Image> image;
 
+    // Gtk::Image default size
+    static constexpr int DEFAULT_ICON_SIZE = 16;
+    static TextureCache texture_cache;
+
     Glib::RefPtr<Gio::DBus::Proxy> proxy;
+    // For the GetAll request in flight
+    Glib::RefPtr<Gio::Cancellable> cancellable;
+    // The proxy doesn't load properties, so it doesn't follow
+    // PropertiesChanged either, we subscribe ourselves
+    guint properties_subscription = 0;
 };
 
 
@@ -52,11 +88,10 @@ public:
     void operator=(const SystemTray &) = delete;
 
     std::map<std::string, SystemTrayItem *> registered_items;
-    // I don't use signal_added and signal_removed in the Widget for now.
-    // It re-creates the full box with signal_changed
+    // signal_added is emitted after the item is in registered_items,
+    // signal_removed before it is deleted
     sigc::signal<void(const Glib::ustring &)> signal_added;
     sigc::signal<void(const Glib::ustring &)> signal_removed;
-    sigc::signal<void()> signal_changed;
 
 private:
     SystemTray();
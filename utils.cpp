@@ -8,10 +8,14 @@
 #include <gtkmm/icontheme.h>
 
 #include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
 
 #include <curl/curl.h>
 #include <sys/auxv.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace Utils {
 
@@ -210,6 +214,66 @@ bool write_binary_file(const Glib::ustring &name, const std::vector<uint8_t> &co
     return true;
 }
 
+static bool write_all(int fd, const std::string &contents)
+{
+    const char *data = contents.data();
+    size_t left = contents.size();
+    while (left > 0) {
+        ssize_t written = write(fd, data, left);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        left -= written;
+    }
+    return true;
+}
+
+bool write_file_atomic(const std::string &name, const std::string &contents)
+{
+    const std::string tmp_name = name + ".tmp";
+    int fd = open(tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log(LogSeverity::ERROR, std::format("Utils::write_file_atomic: Cannot open file {}, Error: {}", tmp_name, strerror(errno)));
+        return false;
+    }
+    if (!write_all(fd, contents)) {
+        log(LogSeverity::ERROR, std::format("Utils::write_file_atomic: Cannot write file {}, Error: {}", tmp_name, strerror(errno)));
+        close(fd);
+        unlink(tmp_name.c_str());
+        return false;
+    }
+    // The data must be on disk before the rename makes it visible
+    if (fsync(fd) < 0 || close(fd) < 0) {
+        log(LogSeverity::ERROR, std::format("Utils::write_file_atomic: Cannot sync file {}, Error: {}", tmp_name, strerror(errno)));
+        unlink(tmp_name.c_str());
+        return false;
+    }
+    if (rename(tmp_name.c_str(), name.c_str()) < 0) {
+        log(LogSeverity::ERROR, std::format("Utils::write_file_atomic: Cannot rename {} to {}, Error: {}", tmp_name, name, strerror(errno)));
+        unlink(tmp_name.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool append_file(const std::string &name, const std::string &contents)
+{
+    int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log(LogSeverity::ERROR, std::format("Utils::append_file: Cannot open file {}, Error: {}", name, strerror(errno)));
+        return false;
+    }
+    if (!write_all(fd, contents) || fdatasync(fd) < 0) {
+        log(LogSeverity::ERROR, std::format("Utils::append_file: Cannot write file {}, Error: {}", name, strerror(errno)));
+        close(fd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
 
 Glib::RefPtr<Gio::FileMonitor> monitor_file(const Glib::ustring &name)
 {
@@ -36,6 +36,11 @@ Glib::ustring read_file(const Glib::RefPtr<Gio::File> &file);
 
 bool write_file(const Glib::ustring &name, const std::string &contents);
 bool write_binary_file(const Glib::ustring &name, const std::vector<uint8_t> &contents);
+// Write to a temporary file in the same directory, sync it and rename it over
+// name, so readers see either the old or the new contents, never a partial file
+bool write_file_atomic(const std::string &name, const std::string &contents);
+// Append to name, creating it if needed, and sync it
+bool append_file(const std::string &name, const std::string &contents);
 
 std::vector<uint8_t> read_binary_file(const Glib::ustring &name);
 std::vector<uint8_t> read_binary_file(const Glib::RefPtr<Gio::File> &file);
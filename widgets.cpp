@@ -4,13 +4,29 @@
 #include "systemtray.h"
 
 #include <glibmm.h>
+#include <giomm/liststore.h>
 #include <gtkmm/label.h>
 #include <gtkmm/gestureclick.h>
 #include <gtkmm/image.h>
+#include <gtkmm/customfilter.h>
+#include <gtkmm/filterlistmodel.h>
+#include <gtkmm/listview.h>
+#include <gtkmm/listitem.h>
+#include <gtkmm/noselection.h>
+#include <gtkmm/progressbar.h>
+#include <gtkmm/scrolledwindow.h>
+#include <gtkmm/searchentry.h>
+#include <gtkmm/signallistitemfactory.h>
 
 #include "utils.h"
 #include "bind.h"
 
+#include <algorithm>
+#include <cmath>
+
+// Notification lists scroll beyond this height
+static const int NOTIFICATIONS_MAX_HEIGHT = 900;
+
 PackageUpdates::PackageUpdates() : dispatcher(), sem(0), working(false)
 {
     update_thread = std::make_shared<std::thread>(&PackageUpdates::update, this);
@@ -116,13 +132,22 @@ public:
         info_button.set_child(info_label);
         info_button.signal_clicked().connect(
             [this]() { Utils::spawn("kitty ncmpcpp"); });
+        progress.add_css_class("mpris-progress");
+        progress.set_valign(Gtk::Align::CENTER);
+        cover.add_css_class("mpris-cover");
+        cover.set_pixel_size(COVER_SIZE);
+        append(cover);
         append(info_button);
         append(prev_button);
         append(play_button);
         append(next_button);
+        append(progress);
         update_player();
     }
-    virtual ~MPlayer() {}
+    virtual ~MPlayer() {
+        if (tick_id)
+            remove_tick_callback(tick_id);
+    }
 
     Glib::ustring get_info() const {
         return player->name + ": " + play_label.get_text() + " " + info_label.get_text();
@@ -157,10 +182,44 @@ public:
         play_label.set_text(status_icon);
         info_label.set_text(std::format("{} - {} - {}", player->title.c_str(), player->album.c_str(), player->artist.c_str()));
         set_css_classes({ class_name });
+
+        // The thumbnail is already small, loading it is cheap
+        if (player->cover_art != cover_art) {
+            cover_art = player->cover_art;
+            if (cover_art != "")
+                cover.set(cover_art);
+            else
+                cover.clear();
+        }
+        cover.set_visible(cover_art != "");
+        progress.set_visible(player->length > 0);
+        update_progress();
+        // Only animate while playing, otherwise the frame clock can sleep
+        if (player->playback_status == PlaybackStatus::PLAYING && player->length > 0) {
+            if (tick_id == 0)
+                tick_id = add_tick_callback([this](const Glib::RefPtr<Gdk::FrameClock> &) { update_progress(); return true; });
+        } else if (tick_id) {
+            remove_tick_callback(tick_id);
+            tick_id = 0;
+        }
     }
     Player *player;
 
 private:
+    void update_progress() {
+        if (player->length <= 0)
+            return;
+        auto fraction = std::clamp(player->get_position() / player->length, 0.0, 1.0);
+        // Don't redraw for changes nobody can see
+        if (std::abs(fraction - progress.get_fraction()) >= 0.001 || fraction == 0.0)
+            progress.set_fraction(fraction);
+    }
+
+    static constexpr int COVER_SIZE = 20;
+    Gtk::Image cover;
+    Glib::ustring cover_art;
+    Gtk::ProgressBar progress;
+    guint tick_id = 0;
     Gtk::Label play_label;
     Gtk::Button play_button;
     Gtk::Label prev_label;
@@ -340,71 +399,53 @@ ScreenShot::ScreenShot()
 // GestureClick instead
 // https://www.reddit.com/r/GTK/comments/190vhj6/comment/kgzxf4n/
 // https://docs.gtk.org/gtk4/input-handling.html
+//
+// NotificationWidgets are recycled by the list views: the widget tree is
+// created once, and bind() fills it with the contents of a notification.
 class NotificationWidget : public Gtk::Box {
 public:
-    NotificationWidget(Notification *notification, bool keep) {
-        if (notification->image_path != "") {
-            icon.set(notification->image_path);
-        } else if (notification->app_icon != "") {
-            icon.set_from_icon_name(notification->app_icon);
-        } else if (notification->desktop_entry != "") {
-            icon.set_from_icon_name(notification->desktop_entry);
-        } else {
-            icon.set_from_icon_name("dialog-information-symbolic");
-        }
+    NotificationWidget(bool keep) : keep(keep) {
         icon.add_css_class("icon");
         icon.set_valign(Gtk::Align::START);
         icon.set_pixel_size(64);
 
-        auto date = Glib::DateTime::create_now_local(notification->time);
-        when.set_text(date.format("%H:%M %A"));
         when.add_css_class("notification-date");
         when.set_xalign(0);
         when.set_justify(Gtk::Justification::LEFT);
+        when.set_hexpand(true);
+
+        count.add_css_class("notification-count");
+        count.set_xalign(1);
 
         title.add_css_class("notification-title");
         title.set_xalign(0);
         title.set_justify(Gtk::Justification::LEFT);
         title.set_wrap(true);
         title.set_use_markup(true);
-        title.set_text(notification->summary);
 
         body.add_css_class("notification-body");
         body.set_xalign(0);
         body.set_justify(Gtk::Justification::LEFT);
         body.set_wrap(true);
         body.set_use_markup(true);
-        body.set_text(notification->body);
 
         actions.add_css_class("actions");
-        for (auto action : notification->actions) {
-            auto button = Gtk::make_managed<Gtk::Button>();
-            button->add_css_class("action-button");
-            button->signal_clicked().connect([notification, action, keep] () {
-                // invoke will remove the notification if it is not resident
-                notification->invoke(action.id);
-                if (keep)
-                    notification->dismiss();
-                else
-                    notification->close();
-            });
-            button->set_label(action.label);
-            actions.append(*button);
-        }
+
+        NotificationImageCache::get_instance().signal_ready.connect(sigc::mem_fun(*this, &NotificationWidget::on_image_ready));
+        NotificationImageCache::get_instance().signal_failed.connect(sigc::mem_fun(*this, &NotificationWidget::on_image_failed));
 
         click = Gtk::GestureClick::create();
         click->set_button(GDK_BUTTON_PRIMARY);
         click->signal_pressed().connect(
-            [notification, keep](int npress, double x, double y) {
-                if (keep)
-                    notification->dismiss();
-                else
-                    notification->close();
+            [this](int npress, double x, double y) {
+                remove_notification(id, keep);
             }, true);
-        add_css_class(std::format("notification-{}", notification->urgency.to_string()));
         set_orientation(Gtk::Orientation::VERTICAL);
         auto tbox = Gtk::make_managed<Gtk::Box>(Gtk::Orientation::VERTICAL);
-        tbox->append(when);
+        auto hbox = Gtk::make_managed<Gtk::Box>();
+        hbox->append(when);
+        hbox->append(count);
+        tbox->append(*hbox);
         tbox->append(title);
         tbox->append(body);
         auto box = Gtk::make_managed<Gtk::Box>();
@@ -415,8 +456,78 @@ public:
         append(actions);
     }
 
+    void bind(const Notification *notification) {
+        id = notification->id;
+        // Images are only loaded for rows being shown. Cached images may
+        // still be encoding, use the icon until they are ready
+        pending_image.clear();
+        if (notification->image_path != "" && NotificationImageCache::get_instance().is_ready(notification->image_path)) {
+            icon.set(notification->image_path);
+        } else {
+            if (notification->image_path != "" && !NotificationImageCache::get_instance().is_failed(notification->image_path))
+                pending_image = notification->image_path;
+            if (notification->app_icon != "") {
+                icon.set_from_icon_name(notification->app_icon);
+            } else if (notification->desktop_entry != "") {
+                icon.set_from_icon_name(notification->desktop_entry);
+            } else {
+                icon.set_from_icon_name("dialog-information-symbolic");
+            }
+        }
+
+        auto date = Glib::DateTime::create_now_local(notification->time);
+        when.set_text(date.format("%H:%M %A"));
+        // Coalesced notifications
+        count.set_text(std::format("{}", notification->count));
+        count.set_visible(notification->count > 1);
+        title.set_text(notification->summary);
+        body.set_text(notification->body);
+
+        for (auto child = actions.get_first_child(); child != nullptr; child = actions.get_first_child())
+            actions.remove(*child);
+        for (auto action : notification->actions) {
+            auto button = Gtk::make_managed<Gtk::Button>();
+            button->add_css_class("action-button");
+            // The row may be unbound by the time the handler returns, so
+            // capture by value
+            button->signal_clicked().connect([id = id, keep = keep, action_id = action.id] () {
+                // invoke will remove the notification if it is not resident
+                NotificationsServer::get_instance().invoke_notification(id, action_id);
+                remove_notification(id, keep);
+            });
+            button->set_label(action.label);
+            actions.append(*button);
+        }
+
+        set_css_classes({ std::format("notification-{}", notification->urgency.to_string()) });
+    }
+
 private:
+    void on_image_ready(const std::string &path) {
+        if (path == pending_image) {
+            icon.set(path);
+            pending_image.clear();
+        }
+    }
+    // Keep the icon
+    void on_image_failed(const std::string &path) {
+        if (path == pending_image)
+            pending_image.clear();
+    }
+
+    static void remove_notification(uint32_t id, bool keep) {
+        auto &server = NotificationsServer::get_instance();
+        if (keep)
+            server.dismiss_notification(id);
+        else
+            server.close_notification(id);
+    }
+
+    bool keep;
+    uint32_t id = 0;
+    std::string pending_image;
     Gtk::Label when;
+    Gtk::Label count;
     Gtk::Image icon;
     Gtk::Label title;
     Gtk::Label body;
@@ -424,6 +535,121 @@ private:
     Glib::RefPtr<Gtk::GestureClick> click;
 };
 
+class NotificationObject : public Glib::Object {
+public:
+    static Glib::RefPtr<NotificationObject> create(Notification *notification) {
+        return Glib::make_refptr_for_instance<NotificationObject>(new NotificationObject(notification));
+    }
+
+    Notification *notification;
+
+protected:
+    NotificationObject(Notification *notification) : notification(notification) {}
+};
+
+// List model of notifications sorted by id, kept in sync with the deltas
+// emitted by NotificationsServer instead of being rebuilt on every change.
+// There is one model of each kind, shared by the windows of all the bars.
+class NotificationsModel {
+public:
+    static NotificationsModel &get_history() {
+        static NotificationsModel history(false);
+        return history;
+    }
+    static NotificationsModel &get_popups() {
+        static NotificationsModel popups(true);
+        return popups;
+    }
+
+    // Avoid copy creation
+    NotificationsModel(const NotificationsModel &) = delete;
+    void operator=(const NotificationsModel &) = delete;
+
+    Glib::RefPtr<Gio::ListStore<NotificationObject>> store;
+
+private:
+    NotificationsModel(bool popup_only) : popup_only(popup_only) {
+        store = Gio::ListStore<NotificationObject>::create();
+        NotificationsServer &server = NotificationsServer::get_instance();
+        std::vector<Notification *> initial;
+        for (auto notification : server.notifications) {
+            if (accept(notification.second))
+                initial.push_back(notification.second);
+        }
+        std::sort(initial.begin(), initial.end(), [](const Notification *a, const Notification *b) { return a->id < b->id; });
+        std::vector<Glib::RefPtr<NotificationObject>> objects;
+        for (auto n : initial)
+            objects.push_back(NotificationObject::create(n));
+        store->splice(0, 0, objects);
+
+        server.signal_added.connect(sigc::mem_fun(*this, &NotificationsModel::update));
+        server.signal_updated.connect(sigc::mem_fun(*this, &NotificationsModel::update));
+        server.signal_removed.connect(sigc::mem_fun(*this, &NotificationsModel::remove));
+        server.signal_cleared.connect([this]() { store->remove_all(); });
+    }
+
+    bool accept(const Notification *notification) const {
+        return !popup_only || notification->popup;
+    }
+
+    // Position of id, or position where it should be inserted
+    guint lower_bound(uint32_t id) const {
+        guint first = 0, count = store->get_n_items();
+        while (count > 0) {
+            guint step = count / 2;
+            if (store->get_item(first + step)->notification->id < id) {
+                first += step + 1;
+                count -= step + 1;
+            } else {
+                count = step;
+            }
+        }
+        return first;
+    }
+
+    void update(Notification *notification) {
+        guint position = lower_bound(notification->id);
+        bool present = position < store->get_n_items() && store->get_item(position)->notification->id == notification->id;
+        if (!accept(notification)) {
+            if (present)
+                store->remove(position);
+        } else if (present) {
+            // Replace the item so the row gets bound again
+            store->splice(position, 1, { NotificationObject::create(notification) });
+        } else {
+            store->insert(position, NotificationObject::create(notification));
+        }
+    }
+
+    void remove(uint32_t id) {
+        guint position = lower_bound(id);
+        if (position < store->get_n_items() && store->get_item(position)->notification->id == id)
+            store->remove(position);
+    }
+
+    bool popup_only;
+};
+
+static Gtk::ListView *create_notifications_view(const Glib::RefPtr<Gio::ListModel> &model, bool keep)
+{
+    auto factory = Gtk::SignalListItemFactory::create();
+    factory->signal_setup().connect([keep](const Glib::RefPtr<Glib::Object> &object) {
+        auto item = std::dynamic_pointer_cast<Gtk::ListItem>(object);
+        item->set_activatable(false);
+        item->set_selectable(false);
+        item->set_child(*Gtk::make_managed<NotificationWidget>(keep));
+    });
+    factory->signal_bind().connect([](const Glib::RefPtr<Glib::Object> &object) {
+        auto item = std::dynamic_pointer_cast<Gtk::ListItem>(object);
+        auto notification = std::dynamic_pointer_cast<NotificationObject>(item->get_item());
+        auto widget = dynamic_cast<NotificationWidget *>(item->get_child());
+        if (notification && widget)
+            widget->bind(notification->notification);
+    });
+    auto view = Gtk::make_managed<Gtk::ListView>(Gtk::NoSelection::create(model), factory);
+    return view;
+}
+
 class DebugBox : public Gtk::Box {
 public:
     DebugBox() : Gtk::Box(Gtk::Orientation::VERTICAL) {}
@@ -436,9 +662,44 @@ class NotificationsWindow : public GtkShellWindow {
 public:
     NotificationsWindow(const Glib::ustring &monitor)
         : GtkShellWindow("gtkshell-notifications", GtkShellAnchor::ANCHOR_TOP | GtkShellAnchor::ANCHOR_RIGHT,
-                         monitor.c_str(), false, GtkShellStretch::STRETCH_NONE) {
-        NotificationsServer &notifications = NotificationsServer::get_instance();
+                         monitor.c_str(), false, GtkShellStretch::STRETCH_NONE), model(NotificationsModel::get_history()) {
         add_css_class("notifications-window");
+        // Typing in the search entry needs keyboard focus
+        set_keyboard_on_demand(true);
+
+        // The search runs on the server index, the filter only checks the
+        // sorted list of matches
+        filter = Gtk::CustomFilter::create([this](const Glib::RefPtr<Glib::ObjectBase> &item) {
+            if (!searching)
+                return true;
+            auto object = std::dynamic_pointer_cast<NotificationObject>(item);
+            return object && std::binary_search(matches.begin(), matches.end(), object->notification->id);
+        });
+        auto filtered = Gtk::FilterListModel::create(model.store, filter);
+        search.add_css_class("notifications-search");
+        search.set_placeholder_text("Search notifications");
+        search.signal_search_changed().connect(sigc::mem_fun(*this, &NotificationsWindow::update_search));
+        search.signal_stop_search().connect([this]() {
+            search.set_text("");
+        });
+
+        auto view = create_notifications_view(filtered, false);
+        view->add_css_class("notifications");
+        scrolled.set_child(*view);
+        scrolled.set_policy(Gtk::PolicyType::NEVER, Gtk::PolicyType::AUTOMATIC);
+        scrolled.set_propagate_natural_height(true);
+        scrolled.set_max_content_height(NOTIFICATIONS_MAX_HEIGHT);
+        auto box = Gtk::make_managed<Gtk::Box>(Gtk::Orientation::VERTICAL);
+        box->append(search);
+        box->append(scrolled);
+        set_child(*box);
+        model.store->signal_items_changed().connect([this](guint position, guint removed, guint added) {
+            if (model.store->get_n_items() == 0)
+                set_visible(false);
+            // New notifications may match
+            else if (searching && added > 0)
+                update_search();
+        });
         // Using -1 for height crashes!
         set_default_size(350, 1);
         set_visible(false);
@@ -446,79 +707,74 @@ public:
     ~NotificationsWindow() {
     }
 
-    void create_widgets() {
-        NotificationsServer &notifications = NotificationsServer::get_instance();
-        box = Gtk::make_managed<Gtk::Box>(Gtk::Orientation::VERTICAL);
-        box->add_css_class("notifications");
-        for (auto notification : notifications.notifications) {
-            const auto n = notification.second;
-            auto nwidget = Gtk::make_managed<NotificationWidget>(notification.second, false);
-            box->append(*nwidget);
-        }
-        // This deletes the old child and its contents
-        unset_child();
-        if (notifications.notifications.size() > 0) {
-            set_child(*box);
-        } else {
-            delete box;
-            set_visible(false);
-        }
+    bool has_notifications() const {
+        return model.store->get_n_items() > 0;
     }
 
 private:
-    Gtk::Box *box;
+    void update_search() {
+        auto text = search.get_text();
+        searching = text != "";
+        if (searching)
+            matches = NotificationsServer::get_instance().search(text);
+        else
+            matches.clear();
+        filter->changed(Gtk::Filter::Change::DIFFERENT);
+    }
+
+    NotificationsModel &model;
+    Gtk::SearchEntry search;
+    Gtk::ScrolledWindow scrolled;
+    Glib::RefPtr<Gtk::CustomFilter> filter;
+    bool searching = false;
+    // Sorted ids
+    std::vector<uint32_t> matches;
 };
 
 class NotificationsPopup : public GtkShellWindow {
 public:
-    NotificationsPopup(const Glib::ustring &monitor)
+    // Without a monitor, the compositor shows the popup on the focused output
+    NotificationsPopup()
         : GtkShellWindow("gtkshell-notifications-popup", GtkShellAnchor::ANCHOR_TOP | GtkShellAnchor::ANCHOR_RIGHT,
-                         monitor.c_str(), false, GtkShellStretch::STRETCH_NONE) {
-        NotificationsServer &notifications = NotificationsServer::get_instance();
-        bind_property_changed(&notifications, "popup",
-            [this]() {
-                create_widgets();
-            });
+                         "", false, GtkShellStretch::STRETCH_NONE), model(NotificationsModel::get_popups()) {
         add_css_class("notifications-window-popup");
+        auto view = create_notifications_view(model.store, true);
+        view->add_css_class("notifications-popup");
+        scrolled.set_child(*view);
+        scrolled.set_policy(Gtk::PolicyType::NEVER, Gtk::PolicyType::AUTOMATIC);
+        scrolled.set_propagate_natural_height(true);
+        scrolled.set_max_content_height(NOTIFICATIONS_MAX_HEIGHT);
+        set_child(scrolled);
+        model.store->signal_items_changed().connect([this](guint position, guint removed, guint added) {
+            set_visible(model.store->get_n_items() > 0);
+        });
         // Using -1 for height crashes!
         set_default_size(350, 1);
+        set_visible(model.store->get_n_items() > 0);
     }
     ~NotificationsPopup() {
     }
 
-    void create_widgets() {
-        NotificationsServer &notifications = NotificationsServer::get_instance();
-        box = Gtk::make_managed<Gtk::Box>(Gtk::Orientation::VERTICAL);
-        box->add_css_class("notifications-popup");
-        size_t visible = 0;
-        for (auto notification : notifications.notifications) {
-            const auto n = notification.second;
-            if (n->popup) {
-                auto nwidget = Gtk::make_managed<NotificationWidget>(notification.second, true);
-                box->append(*nwidget);
-                ++visible;
-            }
-        }
-        // This deletes the old child and its contents
-        unset_child();
-        if (visible > 0) {
-            set_child(*box);
-            set_visible(true);
-        } else {
-            delete box;
-            set_visible(false);
-        }
-    }
-
 private:
-    Gtk::Box *box;
+    NotificationsModel &model;
+    Gtk::ScrolledWindow scrolled;
 };
 
+// All the bars share the popup
+static std::shared_ptr<NotificationsPopup> get_notifications_popup()
+{
+    static std::weak_ptr<NotificationsPopup> popup;
+    auto shared = popup.lock();
+    if (!shared) {
+        shared = std::make_shared<NotificationsPopup>();
+        popup = shared;
+    }
+    return shared;
+}
 
-Notifications::Notifications(const std::string &monitor)
+Notifications::Notifications(const std::string &monitor) : monitor(monitor), window(nullptr)
 {
-    popup = new NotificationsPopup(monitor);
-    window = new NotificationsWindow(monitor);
+    popup = get_notifications_popup();
     NotificationsServer &notifications = NotificationsServer::get_instance();
     bind_property_changed(&notifications, "notifications",
         [this, &notifications]() {
@@ -526,22 +782,24 @@ Notifications::Notifications(const std::string &monitor)
             if (len > 0) {
                 set_css_classes({"notifications-exist"});
                 set_text(std::format(" {}", len));
-                popup->set_visible(true);
             } else {
                 set_css_classes({"notifications-empty"});
                 set_text(std::format(" ", len));
             }
-            window->create_widgets();
         });
     click = Gtk::GestureClick::create();
     click->set_button(0); // 0 = all, 1 = left, 2 = center, 3 = right
     click->signal_pressed().connect([this, &notifications] (int n_press, double x, double y) {
         auto mbutton = this->click->get_current_button();
         if (mbutton == GDK_BUTTON_PRIMARY) {
+            // Most bars never show their window, create it when needed
+            if (window == nullptr)
+                window = new NotificationsWindow(this->monitor);
             auto visible = window->get_visible();
-            window->set_visible(!visible);
+            window->set_visible(!visible && window->has_notifications());
         } else if (mbutton == GDK_BUTTON_SECONDARY) {
-            window->set_visible(false);
+            if (window)
+                window->set_visible(false);
             popup->set_visible(false);
             NotificationsServer::get_instance().clear_notifications();
         }
@@ -551,24 +809,38 @@ Notifications::Notifications(const std::string &monitor)
 
 Notifications::~Notifications()
 {
-    delete popup;
     delete window;
 }
 
 SysTray::SysTray()
 {
     add_css_class("systray");
+    set_hexpand(true);
     SystemTray &tray = SystemTray::get_instance();
-    tray.signal_changed.connect(
-        [this, &tray]() {
-            set_visible(false);
-            auto children = get_children();
-            for (auto child : children)
-                remove(*child);
-            for (auto item : tray.registered_items) {
-                append(*item.second);
+    for (auto item : tray.registered_items)
+        append(*item.second);
+    // Items keep the order of registered_items. Only the item that changes
+    // is inserted or removed, the rest of the tray is not touched.
+    tray.signal_added.connect(
+        [this, &tray](const Glib::ustring &name) {
+            auto iter = tray.registered_items.find(name);
+            if (iter == tray.registered_items.end() || iter->second->get_parent() != nullptr)
+                return;
+            // Go after the closest previous item that is already in this
+            // box, or first if there is none
+            for (auto prev = iter; prev != tray.registered_items.begin();) {
+                --prev;
+                if (prev->second->get_parent() == this) {
+                    insert_child_after(*iter->second, *prev->second);
+                    return;
+                }
             }
-            set_hexpand(true);
-            set_visible(true);
+            prepend(*iter->second);
+        });
+    tray.signal_removed.connect(
+        [this, &tray](const Glib::ustring &name) {
+            auto iter = tray.registered_items.find(name);
+            if (iter != tray.registered_items.end() && iter->second->get_parent() == this)
+                remove(*iter->second);
         });
 }
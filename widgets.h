@@ -64,7 +64,8 @@ public:
     ~Notifications();
 
 private:
-    NotificationsPopup *popup;
+    std::string monitor;
+    std::shared_ptr<NotificationsPopup> popup;
     NotificationsWindow *window;
     Glib::RefPtr<Gtk::GestureClick> click;
 };
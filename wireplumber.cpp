@@ -1,10 +1,22 @@
 #include <gtkmm/icontheme.h>
+#include <gtkmm/listitem.h>
+#include <gtkmm/listview.h>
+#include <gtkmm/noselection.h>
+#include <gtkmm/scale.h>
+#include <gtkmm/scrolledwindow.h>
+#include <gtkmm/signallistitemfactory.h>
+#include <gtkmm/togglebutton.h>
 
 #include "wireplumber.h"
 
 #include "utils.h"
 
 #include <wp/wp.h>
+#include <spa/param/audio/format-utils.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 
 
 Wireplumber::Wireplumber() :
@@ -19,8 +31,14 @@ Wireplumber::Wireplumber() :
     obj_manager = wp_object_manager_new();
     wp_object_manager_add_interest(obj_manager, WP_TYPE_NODE, WP_CONSTRAINT_TYPE_PW_PROPERTY, "media.class", "=s", "Audio/Sink", nullptr);
     wp_object_manager_add_interest(obj_manager, WP_TYPE_NODE, WP_CONSTRAINT_TYPE_PW_PROPERTY, "media.class", "=s", "Audio/Source", nullptr);
+    wp_object_manager_add_interest(obj_manager, WP_TYPE_NODE, WP_CONSTRAINT_TYPE_PW_PROPERTY, "media.class", "=s", "Stream/Output/Audio", nullptr);
+    wp_object_manager_add_interest(obj_manager, WP_TYPE_NODE, WP_CONSTRAINT_TYPE_PW_PROPERTY, "media.class", "=s", "Stream/Input/Audio", nullptr);
     g_signal_connect_swapped(obj_manager, "installed", G_CALLBACK (obj_mananger_installed), this);
+    g_signal_connect_swapped(obj_manager, "object-added", G_CALLBACK (object_added), this);
+    g_signal_connect_swapped(obj_manager, "object-removed", G_CALLBACK (object_removed), this);
 
+    output_streams = Gio::ListStore<AudioStream>::create();
+    input_streams = Gio::ListStore<AudioStream>::create();
     default_speaker = new AudioDevice(AudioDevice::SPEAKER);
     default_microphone = new AudioDevice(AudioDevice::MICROPHONE);
 
@@ -75,54 +93,160 @@ void Wireplumber::obj_mananger_installed(Wireplumber *self)
     g_signal_connect_swapped(self->defaults, "changed", G_CALLBACK(default_changed), self);
     default_changed(self);
     g_signal_connect_swapped(self->mixer, "changed", G_CALLBACK(mixer_changed), self);
-    mixer_changed(self);
+    mixer_changed(self, AudioDevice::INVALID_ID);
 }
 
-void Wireplumber::default_changed(Wireplumber *self)
+static void read_stream_properties(const Glib::RefPtr<AudioStream> &stream, WpPipewireObject *object)
 {
-    // Get ids for default speaker and microphone
-    uint32_t speaker_id, microphone_id;
-    g_signal_emit_by_name(self->defaults, "get-default-node", "Audio/Sink", &speaker_id);
-    g_signal_emit_by_name(self->defaults, "get-default-node", "Audio/Source", &microphone_id);
-    g_autoptr (WpIterator) iter = wp_object_manager_new_iterator(self->obj_manager);
-    GValue value = G_VALUE_INIT;
-    while (wp_iterator_next(iter, &value)) {
-        auto *object = g_value_get_object(&value);
-        if (WP_IS_NODE(object)) {
-            WpNode *node = WP_NODE(object);
-            WpPipewireObject *pobject = WP_PIPEWIRE_OBJECT(node);
-            const gchar *dev = wp_pipewire_object_get_property(WP_PIPEWIRE_OBJECT(node), "object.id");
-            if (dev != nullptr) {
-                // There is a bug in the defaults plugin that returns the same id for the default Audio/Sink and Audio/Source
-                // because their device is the same, despite their node being different
-                int32_t device_id = std::atoi(dev);
-                if (device_id == speaker_id && speaker_id != self->default_speaker->id) {
-                    self->default_speaker->id = speaker_id;
-                    self->default_speaker->name = wp_pipewire_object_get_property(pobject, "node.description");
-                    update_volume(self, self->default_speaker);
-                    self->speaker_changed();
-                }
-                if (device_id == microphone_id && microphone_id != self->default_microphone->id) {
-                    self->default_microphone->id = microphone_id;
-                    self->default_microphone->name = wp_pipewire_object_get_property(pobject, "node.description");
-                    update_volume(self, self->default_microphone);
-                    self->microphone_changed();
-                }
-            }
+    const gchar *application = wp_pipewire_object_get_property(object, "application.name");
+    if (application == nullptr)
+        application = wp_pipewire_object_get_property(object, "node.name");
+    const gchar *media = wp_pipewire_object_get_property(object, "media.name");
+    stream->application = application != nullptr ? application : "";
+    stream->media = media != nullptr ? media : "";
+}
+
+void Wireplumber::object_added(Wireplumber *self, GObject *object)
+{
+    if (!WP_IS_NODE(object))
+        return;
+    auto pobject = WP_PIPEWIRE_OBJECT(object);
+    const uint32_t id = wp_proxy_get_bound_id(WP_PROXY(object));
+    const gchar *description = wp_pipewire_object_get_property(pobject, "node.description");
+    if (description == nullptr)
+        description = wp_pipewire_object_get_property(pobject, "node.name");
+    // Copy it, the properties may go away with the node
+    self->nodes[id] = { description != nullptr ? description : "", nullptr };
+    const gchar *media_class = wp_pipewire_object_get_property(pobject, "media.class");
+    const gchar *monitor = wp_pipewire_object_get_property(pobject, PW_KEY_STREAM_MONITOR);
+    // Level meters (ours too) are not something to mix
+    if (media_class != nullptr && g_str_has_prefix(media_class, "Stream/") && g_strcmp0(monitor, "true") != 0) {
+        auto stream = AudioStream::create(id);
+        read_stream_properties(stream, pobject);
+        self->nodes[id].stream = stream;
+        if (g_str_equal(media_class, "Stream/Output/Audio"))
+            self->output_streams->append(stream);
+        else
+            self->input_streams->append(stream);
+        g_signal_connect_swapped(object, "notify::properties", G_CALLBACK(properties_changed), self);
+        return;
+    }
+    // The defaults plugin may know about the node before we do
+    if (id == self->default_speaker_id)
+        self->set_default(self->default_speaker, id);
+    if (id == self->default_microphone_id)
+        self->set_default(self->default_microphone, id);
+}
+
+void Wireplumber::object_removed(Wireplumber *self, GObject *object)
+{
+    if (!WP_IS_NODE(object))
+        return;
+    auto node = self->nodes.find(wp_proxy_get_bound_id(WP_PROXY(object)));
+    if (node == self->nodes.end())
+        return;
+    if (auto stream = node->second.stream) {
+        g_signal_handlers_disconnect_by_data(object, self);
+        for (auto store : { self->output_streams, self->input_streams }) {
+            auto [found, position] = store->find(stream);
+            if (found)
+                store->remove(position);
         }
-        g_value_unset(&value);
     }
+    self->nodes.erase(node);
+}
+
+void Wireplumber::properties_changed(Wireplumber *self, GParamSpec *pspec, GObject *object)
+{
+    auto node = self->nodes.find(wp_proxy_get_bound_id(WP_PROXY(object)));
+    if (node == self->nodes.end() || !node->second.stream)
+        return;
+    read_stream_properties(node->second.stream, WP_PIPEWIRE_OBJECT(object));
+    node->second.stream->signal_changed();
+}
+
+void Wireplumber::default_changed(Wireplumber *self)
+{
+    // Get ids for default speaker and microphone
+    g_signal_emit_by_name(self->defaults, "get-default-node", "Audio/Sink", &self->default_speaker_id);
+    g_signal_emit_by_name(self->defaults, "get-default-node", "Audio/Source", &self->default_microphone_id);
+    self->set_default(self->default_speaker, self->default_speaker_id);
+    self->set_default(self->default_microphone, self->default_microphone_id);
+}
+
+void Wireplumber::set_default(AudioDevice *device, uint32_t id)
+{
+    if (id == device->id)
+        return;
+    auto node = nodes.find(id);
+    if (node == nodes.end())
+        return;
+    device->id = id;
+    device->name = node->second.description;
+    update_volume(this, device);
+    if (device->type == AudioDevice::SPEAKER)
+        speaker_changed();
+    else
+        microphone_changed();
+}
+
+void Wireplumber::mixer_changed(Wireplumber *self, guint id)
+{
+    if (id == AudioDevice::INVALID_ID || id == self->default_speaker->id)
+        update_volume(self, self->default_speaker);
+    if (id == AudioDevice::INVALID_ID || id == self->default_microphone->id)
+        update_volume(self, self->default_microphone);
+    // Streams read their volume themselves, and only if they are shown
+    auto node = self->nodes.find(id);
+    if (node != self->nodes.end() && node->second.stream)
+        node->second.stream->signal_changed();
+}
+
+bool Wireplumber::get_node_volume(uint32_t id, double &volume, bool &muted) const
+{
+    GVariant *variant = nullptr;
+    g_signal_emit_by_name(mixer, "get-volume", id, &variant);
+    if (variant == nullptr)
+        return false;
+    double vol = 0.0;
+    gboolean mute = false;
+    g_variant_lookup(variant, "volume", "d", &vol);
+    g_variant_lookup(variant, "mute", "b", &mute);
+    g_clear_pointer(&variant, g_variant_unref);
+    volume = std::pow(vol, 1.0 / 3.0);
+    muted = mute;
+    return true;
 }
 
-void Wireplumber::mixer_changed(Wireplumber *self)
+bool Wireplumber::set_node_volume(uint32_t id, double volume)
 {
-    update_volume(self, self->default_speaker);
-    update_volume(self, self->default_microphone);
+    bool ret = false;
+    GVariantBuilder variant = G_VARIANT_BUILDER_INIT(G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&variant, "{sv}", "volume", g_variant_new_double(std::pow(std::max(volume, 0.0), 3.0)));
+    g_signal_emit_by_name(mixer, "set-volume", id, g_variant_builder_end(&variant), &ret);
+    return ret;
+}
+
+bool Wireplumber::set_node_mute(uint32_t id, bool mute)
+{
+    bool ret = false;
+    GVariantBuilder variant = G_VARIANT_BUILDER_INIT(G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&variant, "{sv}", "mute", g_variant_new_boolean(mute));
+    g_signal_emit_by_name(mixer, "set-volume", id, g_variant_builder_end(&variant), &ret);
+    return ret;
+}
+
+void Wireplumber::volume_changed(AudioDevice *device)
+{
+    if (device->type == AudioDevice::SPEAKER)
+        speaker_volume_changed();
+    else if (device->type == AudioDevice::MICROPHONE)
+        microphone_volume_changed();
 }
 
 void Wireplumber::update_volume(Wireplumber *self, AudioDevice *device)
 {
-    if (device->name == nullptr) {
+    if (device->id == AudioDevice::INVALID_ID) {
         return;
     }
     GVariant *variant = nullptr;
@@ -152,10 +276,7 @@ void Wireplumber::update_volume(Wireplumber *self, AudioDevice *device)
         }
     }
     g_clear_pointer(&variant, g_variant_unref);
-    if (device->type == AudioDevice::SPEAKER)
-        self->speaker_volume_changed();
-    else if (device->type == AudioDevice::MICROPHONE)
-        self->microphone_volume_changed();
+    self->volume_changed(device);
 }
 
 bool Wireplumber::set_volume(AudioDevice *device, double volume, AudioDevice::Scale scale)
@@ -168,7 +289,12 @@ bool Wireplumber::set_volume(AudioDevice *device, double volume, AudioDevice::Sc
         GVariant *volume_variant = g_variant_new_double(volume);
         g_variant_builder_add(&variant, "{sv}", "volume", volume_variant);
         g_signal_emit_by_name(mixer, "set-volume", device->id, g_variant_builder_end(&variant), &ret);
-        update_volume(this, device);
+        // Show the new value now, the mixer "changed" signal brings the
+        // real one without us asking for it
+        if (ret) {
+            device->set_volume(volume, AudioDevice::Scale::CUBIC);
+            volume_changed(device);
+        }
     }
     return ret;
 }
@@ -193,7 +319,10 @@ bool Wireplumber::set_mute(AudioDevice *device, bool mute)
         GVariant *mute_variant = g_variant_new_boolean(mute);
         g_variant_builder_add(&variant, "{sv}", "mute", mute_variant);
         g_signal_emit_by_name(mixer, "set-volume", device->id, g_variant_builder_end(&variant), &ret);
-        update_volume(this, device);
+        if (ret) {
+            device->muted = mute;
+            volume_changed(device);
+        }
     }
     return ret;
 }
@@ -208,7 +337,342 @@ Glib::ustring Wireplumber::get_name(AudioDevice *device) const
     return device->name;
 }
 
-SpeakerIndicator::SpeakerIndicator()
+// Small quantum for the meters, they only need a few ms of audio
+static const char *METER_LATENCY = "256/48000";
+// Lowest level shown by the meters
+static const float METER_FLOOR_DB = -60.0f;
+
+PeakMeter::PeakMeter(AudioDevice::Type type, Gtk::Widget &widget) : type(type), widget(widget)
+{
+    dispatcher.connect(sigc::mem_fun(*this, &PeakMeter::on_dispatcher_notify));
+}
+
+PeakMeter::~PeakMeter()
+{
+    stop();
+}
+
+void PeakMeter::start()
+{
+    if (running())
+        return;
+
+    static const pw_stream_events events = {
+        .version = PW_VERSION_STREAM_EVENTS,
+        .process = on_process,
+    };
+
+    loop = pw_thread_loop_new("gtkshell-meter", nullptr);
+    auto props = pw_properties_new(
+        PW_KEY_MEDIA_TYPE, "Audio",
+        PW_KEY_MEDIA_CATEGORY, "Capture",
+        PW_KEY_MEDIA_ROLE, "DSP",
+        PW_KEY_STREAM_MONITOR, "true",
+        PW_KEY_NODE_LATENCY, METER_LATENCY,
+        PW_KEY_APP_NAME, "gtkshell",
+        nullptr);
+    // Autoconnect follows the default source, or the default sink's monitor
+    if (type == AudioDevice::SPEAKER)
+        pw_properties_set(props, PW_KEY_STREAM_CAPTURE_SINK, "true");
+    stream = pw_stream_new_simple(pw_thread_loop_get_loop(loop), "gtkshell-meter", props, &events, this);
+    if (stream == nullptr) {
+        Utils::log(Utils::LogSeverity::ERROR, std::format("PeakMeter: cannot create stream: {}", strerror(errno)));
+        pw_thread_loop_destroy(loop);
+        loop = nullptr;
+        return;
+    }
+
+    // Mono float, PipeWire downmixes for us
+    uint8_t buffer[1024];
+    spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    spa_audio_info_raw info = {};
+    info.format = SPA_AUDIO_FORMAT_F32;
+    info.channels = 1;
+    const spa_pod *params[1] = { spa_format_audio_raw_build(&builder, SPA_PARAM_EnumFormat, &info) };
+    int res = pw_stream_connect(stream, PW_DIRECTION_INPUT, PW_ID_ANY,
+                                static_cast<pw_stream_flags>(PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS),
+                                params, 1);
+    if (res < 0) {
+        Utils::log(Utils::LogSeverity::ERROR, std::format("PeakMeter: cannot connect stream: {}", strerror(-res)));
+        pw_stream_destroy(stream);
+        pw_thread_loop_destroy(loop);
+        stream = nullptr;
+        loop = nullptr;
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        peak = sum = 0.0f;
+        count = 0;
+    }
+    pending = false;
+    pw_thread_loop_start(loop);
+}
+
+void PeakMeter::stop()
+{
+    if (!running())
+        return;
+    // After this the thread is gone and on_process cannot run anymore
+    pw_thread_loop_stop(loop);
+    pw_stream_destroy(stream);
+    pw_thread_loop_destroy(loop);
+    stream = nullptr;
+    loop = nullptr;
+}
+
+// Runs in the thread loop. Without PW_STREAM_FLAG_RT_PROCESS this is not the
+// realtime data thread, so the reduction never delays the graph.
+void PeakMeter::on_process(void *data)
+{
+    auto self = static_cast<PeakMeter *>(data);
+    pw_buffer *buffer = pw_stream_dequeue_buffer(self->stream);
+    if (buffer == nullptr)
+        return;
+
+    size_t n = 0;
+    const spa_data &d = buffer->buffer->datas[0];
+    if (d.data != nullptr && d.chunk != nullptr) {
+        const uint32_t offset = std::min(d.chunk->offset, d.maxsize);
+        const uint32_t size = std::min(d.chunk->size, d.maxsize - offset);
+        n = size / sizeof(float);
+        float peak, sum;
+        reduce(reinterpret_cast<const float *>(static_cast<const uint8_t *>(d.data) + offset), n, peak, sum);
+        std::lock_guard<std::mutex> lock(self->mtx);
+        self->peak = std::max(self->peak, peak);
+        self->sum += sum;
+        self->count += n;
+    }
+    pw_stream_queue_buffer(self->stream, buffer);
+
+    if (n > 0 && !self->pending.exchange(true))
+        self->dispatcher.emit();
+}
+
+void PeakMeter::reduce(const float *samples, size_t n, float &peak, float &sum)
+{
+    // GCC vector extensions, compiled to whatever SIMD the target has
+    typedef float v8f __attribute__((vector_size(8 * sizeof(float))));
+    const size_t LANES = sizeof(v8f) / sizeof(float);
+
+    v8f vpeak = {};
+    v8f vsum = {};
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        v8f v;
+        memcpy(&v, samples + i, sizeof(v));
+        const v8f a = v < 0 ? -v : v;
+        vpeak = vpeak > a ? vpeak : a;
+        vsum += v * v;
+    }
+    peak = 0.0f;
+    sum = 0.0f;
+    for (size_t lane = 0; lane < LANES; ++lane) {
+        peak = std::max(peak, vpeak[lane]);
+        sum += vsum[lane];
+    }
+    for (; i < n; ++i) {
+        peak = std::max(peak, std::fabs(samples[i]));
+        sum += samples[i] * samples[i];
+    }
+}
+
+void PeakMeter::on_dispatcher_notify()
+{
+    float peak, rms;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        peak = this->peak;
+        rms = count > 0 ? std::sqrt(sum / count) : 0.0f;
+        this->peak = sum = 0.0f;
+        count = 0;
+    }
+    if (running())
+        signal_level.emit(peak, rms);
+    // The thread loop can notify again once the next frame has started
+    widget.add_tick_callback([this](const Glib::RefPtr<Gdk::FrameClock> &clock) -> bool {
+        pending = false;
+        return false;
+    });
+}
+
+static double meter_value(float level)
+{
+    if (level <= 0.0f)
+        return 0.0;
+    return std::clamp((20.0f * std::log10(level) - METER_FLOOR_DB) / -METER_FLOOR_DB, 0.0f, 1.0f);
+}
+
+static void setup_meter(Gtk::LevelBar &level, PeakMeter &meter)
+{
+    level.set_orientation(Gtk::Orientation::VERTICAL);
+    level.set_inverted(true);
+    level.set_mode(Gtk::LevelBar::Mode::CONTINUOUS);
+    level.set_visible(false);
+    level.add_css_class("meter");
+    meter.signal_level.connect([&level](float peak, float rms) {
+        level.set_value(meter_value(rms));
+        if (peak >= 1.0f)
+            level.add_css_class("clipping");
+        else
+            level.remove_css_class("clipping");
+    });
+}
+
+static void update_meter(Gtk::LevelBar &level, PeakMeter &meter, bool active)
+{
+    if (active) {
+        meter.start();
+    } else {
+        meter.stop();
+        level.set_value(0.0);
+    }
+    level.set_visible(active && meter.running());
+}
+
+// Streams popover size
+static const int STREAMS_MAX_HEIGHT = 400;
+static const int STREAMS_WIDTH = 300;
+
+// A row of the streams popover. Rows are recycled by the list view, and
+// only bound rows listen to their stream.
+class StreamRow : public Gtk::Box {
+public:
+    StreamRow() : Gtk::Box(Gtk::Orientation::VERTICAL) {
+        add_css_class("stream");
+        name.set_xalign(0.0);
+        name.set_ellipsize(Pango::EllipsizeMode::END);
+        name.set_max_width_chars(STREAM_NAME_CHARS);
+        volume.set_range(0.0, 1.0);
+        volume.set_increments(0.01, 0.1);
+        volume.set_hexpand(true);
+        volume.signal_value_changed().connect(sigc::mem_fun(*this, &StreamRow::on_volume_changed));
+        // Volume echoes arriving while dragging would snap the slider back
+        auto drag = Gtk::GestureClick::create();
+        drag->set_propagation_phase(Gtk::PropagationPhase::CAPTURE);
+        drag->signal_begin().connect([this](Gdk::EventSequence *) { dragging = true; });
+        drag->signal_end().connect([this](Gdk::EventSequence *) { dragging = false; });
+        volume.add_controller(drag);
+        mute.signal_toggled().connect([this]() {
+            if (!updating && stream)
+                Wireplumber::get_instance().set_node_mute(stream->id, mute.get_active());
+        });
+        auto controls = Gtk::make_managed<Gtk::Box>();
+        controls->append(mute);
+        controls->append(volume);
+        append(name);
+        append(*controls);
+    }
+
+    void bind(const Glib::RefPtr<AudioStream> &stream) {
+        this->stream = stream;
+        changed = stream->signal_changed.connect(sigc::mem_fun(*this, &StreamRow::update));
+        update();
+    }
+    void unbind() {
+        changed.disconnect();
+        stream = nullptr;
+    }
+
+private:
+    // The slider changes much faster than frames while dragging. Like
+    // scroll_volume(), keep the last value and set it once per frame.
+    void on_volume_changed() {
+        if (updating || !stream)
+            return;
+        pending_id = stream->id;
+        pending_volume = volume.get_value();
+        if (volume_scheduled)
+            return;
+        volume_scheduled = true;
+        volume.add_tick_callback([this](const Glib::RefPtr<Gdk::FrameClock> &) {
+            volume_scheduled = false;
+            Wireplumber::get_instance().set_node_volume(pending_id, pending_volume);
+            return false;
+        });
+    }
+
+    void update() {
+        updating = true;
+        name.set_text(stream->media != "" ? stream->application + ": " + stream->media : stream->application);
+        double vol;
+        bool muted;
+        if (Wireplumber::get_instance().get_node_volume(stream->id, vol, muted)) {
+            if (!dragging && !volume_scheduled)
+                volume.set_value(vol);
+            mute.set_active(muted);
+            mute.set_icon_name(muted ? "audio-volume-muted-symbolic" : "audio-volume-high-symbolic");
+        }
+        updating = false;
+    }
+
+    static constexpr int STREAM_NAME_CHARS = 40;
+    Glib::RefPtr<AudioStream> stream;
+    sigc::connection changed;
+    bool updating = false;
+    bool dragging = false;
+    bool volume_scheduled = false;
+    uint32_t pending_id = 0;
+    double pending_volume = 0.0;
+    Gtk::Label name;
+    Gtk::ToggleButton mute;
+    Gtk::Scale volume;
+};
+
+static void setup_streams_popover(Gtk::Popover &popover, Gtk::Widget &parent, const Glib::RefPtr<Gio::ListStore<AudioStream>> &store)
+{
+    auto factory = Gtk::SignalListItemFactory::create();
+    factory->signal_setup().connect([](const Glib::RefPtr<Glib::Object> &object) {
+        auto item = std::dynamic_pointer_cast<Gtk::ListItem>(object);
+        item->set_activatable(false);
+        item->set_selectable(false);
+        item->set_child(*Gtk::make_managed<StreamRow>());
+    });
+    factory->signal_bind().connect([](const Glib::RefPtr<Glib::Object> &object) {
+        auto item = std::dynamic_pointer_cast<Gtk::ListItem>(object);
+        auto stream = std::dynamic_pointer_cast<AudioStream>(item->get_item());
+        auto row = dynamic_cast<StreamRow *>(item->get_child());
+        if (stream && row)
+            row->bind(stream);
+    });
+    factory->signal_unbind().connect([](const Glib::RefPtr<Glib::Object> &object) {
+        auto item = std::dynamic_pointer_cast<Gtk::ListItem>(object);
+        if (auto row = dynamic_cast<StreamRow *>(item->get_child()))
+            row->unbind();
+    });
+    auto view = Gtk::make_managed<Gtk::ListView>(Gtk::NoSelection::create(store), factory);
+    view->add_css_class("streams");
+    auto scrolled = Gtk::make_managed<Gtk::ScrolledWindow>();
+    scrolled->set_child(*view);
+    scrolled->set_policy(Gtk::PolicyType::NEVER, Gtk::PolicyType::AUTOMATIC);
+    scrolled->set_propagate_natural_height(true);
+    scrolled->set_max_content_height(STREAMS_MAX_HEIGHT);
+    scrolled->set_min_content_width(STREAMS_WIDTH);
+    popover.set_child(*scrolled);
+    popover.set_parent(parent);
+}
+
+// Scroll events arrive much faster than frames, specially from touchpads.
+// Steps are added up and applied once per frame from a tick callback.
+static void scroll_volume(Gtk::Widget &widget, AudioDevice *device, double steps, double &pending, bool &scheduled)
+{
+    pending += steps;
+    if (scheduled)
+        return;
+    scheduled = true;
+    widget.add_tick_callback([device, &pending, &scheduled](const Glib::RefPtr<Gdk::FrameClock> &) {
+        // Keep the fraction for the next frame
+        int whole = static_cast<int>(pending);
+        pending -= whole;
+        scheduled = false;
+        if (whole != 0)
+            Wireplumber::get_instance().inc_volume(device, whole);
+        return false;
+    });
+}
+
+SpeakerIndicator::SpeakerIndicator() : meter(AudioDevice::SPEAKER, *this)
 {
     auto &wireplumber = Wireplumber::get_instance();
 
@@ -237,18 +701,29 @@ SpeakerIndicator::SpeakerIndicator()
     button.set_child(icon);
     append(button);
     append(label);
+    append(level);
     add_css_class("speaker");
+    setup_streams_popover(streams, *this, wireplumber.output_streams);
+
+    // Meter while hovered or while the streams are shown
+    setup_meter(level, meter);
+    motion = Gtk::EventControllerMotion::create();
+    motion->signal_enter().connect([this](double x, double y) { update_meter(level, meter, true); });
+    motion->signal_leave().connect([this]() { update_meter(level, meter, streams.get_visible()); });
+    add_controller(motion);
+    streams.signal_show().connect([this]() { update_meter(level, meter, true); });
+    streams.signal_hide().connect([this]() { update_meter(level, meter, motion->contains_pointer()); });
 
     // Scroll for volume up/down
     scroll = Gtk::EventControllerScroll::create();
     scroll->set_flags(Gtk::EventControllerScroll::Flags::VERTICAL);
     scroll->signal_scroll().connect([this, &wireplumber] (double dx, double dy) -> bool {
-        wireplumber.inc_volume(wireplumber.default_speaker, -dy * 100); // 100 is just a multiplier, nothing to do with %
+        scroll_volume(*this, wireplumber.default_speaker, -dy * 100, pending_steps, volume_scheduled); // 100 is just a multiplier, nothing to do with %
         return true;
     }, true);
     add_controller(scroll);
 
-    // Left click to mute, right click for pavucontrol
+    // Left click to mute, middle click for streams, right click for pavucontrol
     click = Gtk::GestureClick::create();
     click->set_button(0); // 0 = all, 1 = left, 2 = center, 3 = right
     click->signal_pressed().connect([this, &wireplumber] (int n_press, double x, double y) {
@@ -257,12 +732,19 @@ SpeakerIndicator::SpeakerIndicator()
             Utils::spawn("pavucontrol");
         } else if (mbutton == GDK_BUTTON_PRIMARY) {
             wireplumber.set_mute(wireplumber.default_speaker, !wireplumber.get_mute(wireplumber.default_speaker));
+        } else if (mbutton == GDK_BUTTON_MIDDLE) {
+            streams.popup();
         }
     }, true);
     add_controller(click);
 }
 
-MicrophoneIndicator::MicrophoneIndicator()
+SpeakerIndicator::~SpeakerIndicator()
+{
+    streams.unparent();
+}
+
+MicrophoneIndicator::MicrophoneIndicator() : meter(AudioDevice::MICROPHONE, *this)
 {
     auto &wireplumber = Wireplumber::get_instance();
 
@@ -292,17 +774,28 @@ MicrophoneIndicator::MicrophoneIndicator()
     button.set_child(icon);
     append(button);
     append(label);
+    append(level);
     add_css_class("microphone");
+    setup_streams_popover(streams, *this, wireplumber.input_streams);
+
+    // Meter while hovered or while the streams are shown
+    setup_meter(level, meter);
+    motion = Gtk::EventControllerMotion::create();
+    motion->signal_enter().connect([this](double x, double y) { update_meter(level, meter, true); });
+    motion->signal_leave().connect([this]() { update_meter(level, meter, streams.get_visible()); });
+    add_controller(motion);
+    streams.signal_show().connect([this]() { update_meter(level, meter, true); });
+    streams.signal_hide().connect([this]() { update_meter(level, meter, motion->contains_pointer()); });
 
     scroll = Gtk::EventControllerScroll::create();
     scroll->set_flags(Gtk::EventControllerScroll::Flags::VERTICAL);
     scroll->signal_scroll().connect([this, &wireplumber] (double dx, double dy) -> bool {
-        wireplumber.inc_volume(wireplumber.default_microphone, -dy * 100); // 100 is just a multiplier, nothing to do with %
+        scroll_volume(*this, wireplumber.default_microphone, -dy * 100, pending_steps, volume_scheduled); // 100 is just a multiplier, nothing to do with %
         return true;
     }, true);
     add_controller(scroll);
 
-    // Left click to mute, right click for pavucontrol
+    // Left click to mute, middle click for streams, right click for pavucontrol
     click = Gtk::GestureClick::create();
     click->set_button(0); // 0 = all, 1 = left, 2 = center, 3 = right
     click->signal_pressed().connect([this, &wireplumber] (int n_press, double x, double y) {
@@ -311,7 +804,14 @@ MicrophoneIndicator::MicrophoneIndicator()
             Utils::spawn("pavucontrol");
         } else if (mbutton == GDK_BUTTON_PRIMARY) {
             wireplumber.set_mute(wireplumber.default_microphone, !wireplumber.get_mute(wireplumber.default_microphone));
+        } else if (mbutton == GDK_BUTTON_MIDDLE) {
+            streams.popup();
         }
     }, true);
     add_controller(click);
 }
+
+MicrophoneIndicator::~MicrophoneIndicator()
+{
+    streams.unparent();
+}
@@ -8,7 +8,17 @@
 #include <gtkmm/gestureclick.h>
 #include <gtkmm/eventcontrollerscroll.h>
 #include <gtkmm/label.h>
+#include <gtkmm/levelbar.h>
+#include <gtkmm/eventcontrollermotion.h>
+#include <gtkmm/popover.h>
+#include <giomm/liststore.h>
 #include <wp/wp.h>
+#include <pipewire/pipewire.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 
 class AudioDevice {
 public:
@@ -22,7 +32,9 @@ public:
         CUBIC
     } Scale;
 
-    AudioDevice(AudioDevice::Type device) : type(device), name(nullptr), id(-1),
+    static constexpr uint32_t INVALID_ID = -1;
+
+    AudioDevice(AudioDevice::Type device) : type(device), id(INVALID_ID),
         muted(false), volume(0.0), min_step(0.0), scale (Scale::LINEAR) {}
 
 private:
@@ -46,7 +58,7 @@ private:
     }
 
     Type type;
-    const gchar *name;
+    std::string name;
     uint32_t id;
     bool muted;
     double volume; // in linear scale
@@ -55,6 +67,24 @@ private:
 };
 
 
+// An application stream, Stream/Output/Audio or Stream/Input/Audio
+class AudioStream : public Glib::Object {
+public:
+    static Glib::RefPtr<AudioStream> create(uint32_t id) {
+        return Glib::make_refptr_for_instance<AudioStream>(new AudioStream(id));
+    }
+
+    uint32_t id;
+    Glib::ustring application;
+    Glib::ustring media;
+
+    // Properties or volume changed
+    sigc::signal<void()> signal_changed;
+
+protected:
+    AudioStream(uint32_t id) : id(id) {}
+};
+
 class Wireplumber : public Glib::Object {
 public:
     static Wireplumber &get_instance();
@@ -79,16 +109,31 @@ public:
     bool get_mute(AudioDevice *device) const;
     bool inc_volume(AudioDevice *device, int steps);
 
+    // Application streams, kept up to date incrementally
+    Glib::RefPtr<Gio::ListStore<AudioStream>> output_streams;
+    Glib::RefPtr<Gio::ListStore<AudioStream>> input_streams;
+    // Volume of any node in linear scale, read from the mixer when asked
+    bool get_node_volume(uint32_t id, double &volume, bool &muted) const;
+    bool set_node_volume(uint32_t id, double volume);
+    bool set_node_mute(uint32_t id, bool mute);
+
 private:
     Wireplumber();
     virtual ~Wireplumber();
 
     static void obj_mananger_installed(Wireplumber *self);
+    static void object_added(Wireplumber *self, GObject *object);
+    static void object_removed(Wireplumber *self, GObject *object);
     static void plugin_loaded(WpObject *obj, GAsyncResult *result, Wireplumber *self);
     static void plugin_activated(WpObject *obj, GAsyncResult *result, Wireplumber *self);
     static void default_changed(Wireplumber *self);
-    static void mixer_changed(Wireplumber *self);
+    // id is the node that changed, INVALID_ID for all of them
+    static void mixer_changed(Wireplumber *self, guint id);
+    static void properties_changed(Wireplumber *self, GParamSpec *pspec, GObject *object);
     static void update_volume(Wireplumber *self, AudioDevice *device);
+    void volume_changed(AudioDevice *device);
+    // Makes node id the default device if we know it
+    void set_default(AudioDevice *device, uint32_t id);
 
     WpCore *core;
     WpObjectManager *obj_manager;
@@ -96,30 +141,101 @@ private:
     WpPlugin *defaults;
     WpPlugin *mixer;
     int pending_plugins;
+
+    typedef struct {
+        std::string description;
+        // Only for application streams
+        Glib::RefPtr<AudioStream> stream;
+    } Node;
+    // Nodes by id, kept from object-added and object-removed
+    std::unordered_map<uint32_t, Node> nodes;
+    // Default nodes according to the defaults plugin, they may not be in
+    // nodes yet
+    uint32_t default_speaker_id = AudioDevice::INVALID_ID;
+    uint32_t default_microphone_id = AudioDevice::INVALID_ID;
+};
+
+// Level of the default sink (its monitor) or source. Capture only happens
+// between start() and stop(), samples are reduced in the PipeWire thread loop
+// and the main loop gets at most one update per frame of the widget.
+class PeakMeter {
+public:
+    PeakMeter(AudioDevice::Type type, Gtk::Widget &widget);
+    ~PeakMeter();
+
+    PeakMeter(const PeakMeter &) = delete;
+    void operator=(const PeakMeter &) = delete;
+
+    void start();
+    void stop();
+    bool running() const { return loop != nullptr; }
+
+    // Peak and RMS in linear scale since the last update
+    sigc::signal<void(float, float)> signal_level;
+
+private:
+    static void on_process(void *data);
+    // Absolute peak and sum of squares of n samples
+    static void reduce(const float *samples, size_t n, float &peak, float &sum);
+    void on_dispatcher_notify();
+
+    AudioDevice::Type type;
+    Gtk::Widget &widget;
+    pw_thread_loop *loop = nullptr;
+    pw_stream *stream = nullptr;
+
+    // Shared with the thread loop
+    std::mutex mtx;
+    float peak = 0.0f;
+    float sum = 0.0f;
+    size_t count = 0;
+    // Set when the main loop has been notified, cleared on the next frame
+    std::atomic<bool> pending = false;
+    Glib::Dispatcher dispatcher;
 };
 
 class SpeakerIndicator : public Gtk::Box {
 public:
     SpeakerIndicator();
+    ~SpeakerIndicator();
 
 private:
+    // Middle click lists the application streams
+    Gtk::Popover streams;
     Gtk::Button button;
     Gtk::Image icon;
     Gtk::Label label;
+    // Only metering while hovered or showing the streams
+    Gtk::LevelBar level;
+    PeakMeter meter;
+    Glib::RefPtr<Gtk::EventControllerMotion> motion;
     Glib::RefPtr<Gtk::GestureClick> click;
     Glib::RefPtr<Gtk::EventControllerScroll> scroll;
+    // Scroll steps not applied yet
+    double pending_steps = 0;
+    bool volume_scheduled = false;
 };
 
 class MicrophoneIndicator : public Gtk::Box {
 public:
     MicrophoneIndicator();
+    ~MicrophoneIndicator();
 
 private:
+    // Middle click lists the application streams
+    Gtk::Popover streams;
     Gtk::Button button;
     Gtk::Image icon;
     Gtk::Label label;
+    // Only metering while hovered or showing the streams
+    Gtk::LevelBar level;
+    PeakMeter meter;
+    Glib::RefPtr<Gtk::EventControllerMotion> motion;
     Glib::RefPtr<Gtk::GestureClick> click;
     Glib::RefPtr<Gtk::EventControllerScroll> scroll;
+    // Scroll steps not applied yet
+    double pending_steps = 0;
+    bool volume_scheduled = false;
 };
 
 